@@ -30,13 +30,42 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h> /* clock_gettime() */
 
 #include "nanoid.h"
+#include "nanoid_chacha.h"
 #include "nanoid_rand.h"
+#include "nanoid_simd.h"
 
 /* Alphabet: A-Za-z0-9-_ (i.e., base64url; see RFC 4648, Section 5) */
-static const unsigned char default_alphabet[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static const unsigned char default_alphabet[] = NANOID_ALPHABET;
+
+
+/*
+ * Multiply two 64-bit integers; returns the high 64 bits of the product
+ * and stores the low 64 bits into <*lo>.
+ */
+static inline uint64_t
+mul64(uint64_t a, uint64_t b, uint64_t *lo)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ unsigned __int128 m = (unsigned __int128)a * b;
+
+    *lo = (uint64_t)m;
+    return (uint64_t)(m >> 64);
+#else
+    uint64_t a0 = a & 0xffffffffU, a1 = a >> 32;
+    uint64_t b0 = b & 0xffffffffU, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t mid = (p00 >> 32) + (p01 & 0xffffffffU) + (p10 & 0xffffffffU);
+
+    *lo = (mid << 32) | (p00 & 0xffffffffU);
+    return p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+}
 
 
 /*
@@ -65,57 +94,1987 @@ roundup2(uint32_t v)
 }
 
 
-void *
-nanoid_generate_r(void *buf, size_t buflen, const unsigned char *alphabet,
-                  size_t alphacnt)
+/*
+ * Integer square root, rounded up.
+ */
+static inline size_t
+isqrt_up(size_t v)
 {
-    if (alphabet == NULL) {
-        alphabet = default_alphabet;
-        alphacnt = sizeof(default_alphabet) - 1;
+    size_t x, y;
+
+    if (v < 2)
+        return v;
+
+    x = v;
+    y = (x + 1) / 2;
+    while (y < x) {
+        x = y;
+        y = (x + v / x) / 2;
     }
 
-    if (alphacnt <= 1 || alphacnt >= 256) {
-        errno = EINVAL;
-        return NULL;
+    return (x * x < v) ? x + 1 : x;
+}
+
+
+/* Random data statistics of the current thread */
+static __thread struct nanoid_stats rng_stats;
+
+
+/*
+ * Random sources.
+ *
+ * The selected source provides the random data of the system engine, and
+ * seeds the ChaCha engine.  It is called with at most <max> bytes at once.
+ */
+#define SOURCE_MAX 65536
+
+struct rng_source {
+    const char          *name;
+    size_t              max;
+    nanoid_random_fn    fn;
+    void                *ctx;
+};
+
+
+static int
+source_auto(void *ctx, void *buf, size_t n)
+{
+    (void)ctx;
+    return generate_randombytes(buf, n);
+}
+
+
+#if defined(HAVE_VDSO_GETRANDOM)
+static int
+source_vdso(void *ctx, void *buf, size_t n)
+{
+    (void)ctx;
+    return vdso_getrandom(buf, n);
+}
+#else
+#define source_vdso NULL
+#endif
+
+
+#if defined(HAVE_GETENTROPY)
+static int
+source_getentropy(void *ctx, void *buf, size_t n)
+{
+    (void)ctx;
+    return getentropy(buf, n);
+}
+#else
+#define source_getentropy NULL
+#endif
+
+
+#if defined(HAVE_GETRANDOM)
+static int
+source_getrandom(void *ctx, void *buf, size_t n)
+{
+    (void)ctx;
+    return getrandom_randombytes(buf, n);
+}
+#else
+#define source_getrandom NULL
+#endif
+
+
+#if defined(HAVE_ARC4RANDOM_BUF)
+static int
+source_arc4random(void *ctx, void *buf, size_t n)
+{
+    (void)ctx;
+    arc4random_buf(buf, n);
+    return 0;
+}
+#else
+#define source_arc4random NULL
+#endif
+
+
+static int
+source_urandom(void *ctx, void *buf, size_t n)
+{
+    (void)ctx;
+    return urandom_randombytes(buf, n);
+}
+
+
+/*
+ * Deterministic source: xoshiro256** seeded with SplitMix64, one stream
+ * per thread (numbered in the order of their first draw after seeding).
+ * NOT secure; only for reproducible benchmarks and tests.
+ * Credit: https://prng.di.unimi.it/
+ */
+struct seeded_state {
+    unsigned int    gen;
+    uint64_t        s[4];
+};
+
+static uint64_t seeded_seed;
+static unsigned int seeded_gen = 1;
+static unsigned int seeded_nthreads;
+static __thread struct seeded_state seeded_tls;
+
+
+static inline uint64_t
+splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static inline uint64_t
+xoshiro256ss(uint64_t *s)
+{
+    uint64_t r = s[1] * 5;
+    uint64_t t = s[1] << 17;
+
+    r = ((r << 7) | (r >> 57)) * 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+
+    return r;
+}
+
+
+static int
+source_seeded(void *ctx, void *buf, size_t n)
+{
+    struct seeded_state *st = &seeded_tls;
+    unsigned char *p = buf;
+    uint64_t x, v;
+    int i;
+
+    (void)ctx;
+    if (st->gen != seeded_gen) {
+        x = seeded_seed + 0x9e3779b97f4a7c15ULL *
+            __atomic_fetch_add(&seeded_nthreads, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < 4; ++i)
+            st->s[i] = splitmix64(&x);
+        st->gen = seeded_gen;
     }
 
-    /*
-     * Use a mask instead of 'random % alphacnt' to ensure a uniform
-     * distribution.
-     * See: https://github.com/ai/nanoid#security
-     */
-    uint32_t mask = roundup2((uint32_t)alphacnt) - 1;
+    for (; n >= 8; n -= 8, p += 8) {
+        v = xoshiro256ss(st->s);
+        memcpy(p, &v, 8);
+    }
+    if (n > 0) {
+        v = xoshiro256ss(st->s);
+        memcpy(p, &v, n);
+    }
 
-    /* Size of 32 is tuned by benchmarks for the default size. */
-    unsigned char bytes[32];
-    size_t len = 0;
-    while (1) {
-        if (generate_randombytes(bytes, sizeof(bytes)) == -1)
-            return NULL;
+    return 0;
+}
 
-        size_t i, ai;
-        for (i = 0; i < sizeof(bytes); ++i) {
-            ai = bytes[i] & mask;
-            if (ai >= alphacnt)
-                continue;
-            ((unsigned char *)buf)[len++] = alphabet[ai];
-            if (len == buflen)
-                return buf;
+
+static const struct rng_source rng_sources[] = {
+    { "auto",       RANDOMBYTES_MAX,    source_auto,        NULL },
+    { "vdso",       SOURCE_MAX,         source_vdso,        NULL },
+    { "getentropy", 256,                source_getentropy,  NULL },
+    { "getrandom",  SOURCE_MAX,         source_getrandom,   NULL },
+    { "arc4random", SOURCE_MAX,         source_arc4random,  NULL },
+    { "urandom",    SOURCE_MAX,         source_urandom,     NULL },
+    { "seeded",     SOURCE_MAX,         source_seeded,      NULL },
+};
+
+static struct rng_source rng_source = {
+    "auto", RANDOMBYTES_MAX, source_auto, NULL
+};
+
+
+/*
+ * Fill the buffer <buf> of size <n> from the selected random source,
+ * split into the maximal chunks it allows.
+ */
+static int
+system_randombytes(void *buf, size_t n)
+{
+    unsigned char *p = buf;
+    size_t m;
+
+    while (n > 0) {
+        m = (n < rng_source.max) ? n : rng_source.max;
+        rng_stats.source_calls++;
+        if (rng_source.fn(rng_source.ctx, p, m) == -1)
+            return -1;
+        p += m;
+        n -= m;
+    }
+
+    return 0;
+}
+
+
+int
+nanoid_set_random_source(nanoid_random_fn fn, void *ctx)
+{
+    if (fn == NULL)
+        return nanoid_select_random_source(NULL);
+
+    rng_source.name = "custom";
+    rng_source.max = SOURCE_MAX;
+    rng_source.fn = fn;
+    rng_source.ctx = ctx;
+    return 0;
+}
+
+
+int
+nanoid_select_random_source(const char *name)
+{
+    const struct rng_source *src;
+    size_t i;
+
+    if (name == NULL)
+        name = "auto";
+
+    for (i = 0; i < sizeof(rng_sources) / sizeof(rng_sources[0]); ++i) {
+        src = &rng_sources[i];
+        if (strcmp(src->name, name) != 0)
+            continue;
+        if (src->fn == NULL) {
+            errno = ENOTSUP;
+            return -1;
+        }
+#if defined(HAVE_VDSO_GETRANDOM)
+        if (src->fn == source_vdso && !vdso_getrandom_available()) {
+            errno = ENOTSUP;
+            return -1;
         }
+#endif
+        rng_source = *src;
+        return 0;
     }
 
-    abort(); /* Shouldn't happen. */
+    errno = EINVAL;
+    return -1;
 }
 
 
-const char *
-nanoid_generate(const unsigned char *alphabet, size_t alphacnt)
+int
+nanoid_seed_random_source(unsigned long long seed)
 {
-    static char buf[NANOID_SIZE + 1];
+    seeded_seed = (uint64_t)seed;
+    seeded_nthreads = 0;
+    if (++seeded_gen == 0)
+        seeded_gen = 1;
+    return nanoid_select_random_source("seeded");
+}
 
-    if (nanoid_generate_r(buf, NANOID_SIZE, alphabet, alphacnt) == NULL)
+
+/*
+ * Buffered random engine (NANOID_ENGINE_CHACHA).
+ *
+ * Every thread owns a ChaCha20 keystream buffer, which is seeded and
+ * periodically reseeded from the system random source, so that most
+ * refills are served from memory without a syscall.  The design follows
+ * arc4random(3) of OpenBSD: the key is replaced by keystream output after
+ * every buffer refill, and the returned bytes are wiped from the buffer.
+ *
+ * The per-thread state lives in its own anonymous mapping marked with
+ * MADV_WIPEONFORK (where available), and also carries a fork generation
+ * updated by a pthread_atfork() handler, so a forked child never reuses
+ * the keystream of its parent.
+ */
+
+#define RNG_BUFSZ       (16 * CHACHA_BLOCKSZ)
+#define RNG_RESEED      1600000 /* bytes generated between reseeds */
+
+struct rng_state {
+    int                 rs_initialized; /* zeroed by MADV_WIPEONFORK */
+    unsigned int        rs_forkgen;
+    size_t              rs_have; /* unused bytes at the end of rs_buf */
+    size_t              rs_count; /* bytes until the next reseed */
+    struct chacha_ctx   rs_chacha;
+    unsigned char       rs_buf[RNG_BUFSZ];
+};
+
+static int rng_engine = NANOID_ENGINE_SYSTEM;
+static volatile unsigned int rng_forkgen;
+static pthread_once_t rng_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rng_key;
+static __thread struct rng_state *rng_tls;
+
+
+static void
+rng_wipe(void *p, size_t n)
+{
+    volatile unsigned char *vp = p;
+
+    while (n-- > 0)
+        *vp++ = 0;
+}
+
+
+static void
+rng_atfork_child(void)
+{
+    rng_forkgen++;
+}
+
+
+static void
+rng_destroy(void *p)
+{
+    rng_wipe(p, sizeof(struct rng_state));
+    munmap(p, sizeof(struct rng_state));
+    rng_tls = NULL;
+}
+
+
+static void
+rng_init_once(void)
+{
+    if (pthread_key_create(&rng_key, rng_destroy) != 0)
+        abort();
+    pthread_atfork(NULL, NULL, rng_atfork_child);
+}
+
+
+static struct rng_state *
+rng_get(void)
+{
+    struct rng_state *rs;
+
+    rs = rng_tls;
+    if (rs != NULL)
+        return rs;
+
+    if (pthread_once(&rng_once, rng_init_once) != 0)
         return NULL;
 
-    buf[NANOID_SIZE] = '\0';
-    return buf;
+    rs = mmap(NULL, sizeof(*rs), PROT_READ | PROT_WRITE,
+              MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (rs == MAP_FAILED)
+        return NULL;
+#ifdef MADV_WIPEONFORK
+    (void)madvise(rs, sizeof(*rs), MADV_WIPEONFORK);
+#endif
+
+    if (pthread_setspecific(rng_key, rs) != 0) {
+        munmap(rs, sizeof(*rs));
+        return NULL;
+    }
+
+    rng_tls = rs;
+    return rs;
+}
+
+
+/*
+ * Refill the keystream buffer, mixing in the optional data <dat>, and
+ * immediately rekey with the first bytes of the new keystream.
+ */
+static void
+rng_rekey(struct rng_state *rs, const unsigned char *dat, size_t datlen)
+{
+    size_t i;
+
+    chacha_keystream(&rs->rs_chacha, rs->rs_buf, sizeof(rs->rs_buf));
+    if (dat != NULL) {
+        if (datlen > CHACHA_KEYSZ + CHACHA_IVSZ)
+            datlen = CHACHA_KEYSZ + CHACHA_IVSZ;
+        for (i = 0; i < datlen; ++i)
+            rs->rs_buf[i] ^= dat[i];
+    }
+
+    chacha_keysetup(&rs->rs_chacha, rs->rs_buf, rs->rs_buf + CHACHA_KEYSZ);
+    memset(rs->rs_buf, 0, CHACHA_KEYSZ + CHACHA_IVSZ);
+    rs->rs_have = sizeof(rs->rs_buf) - CHACHA_KEYSZ - CHACHA_IVSZ;
+}
+
+
+static int
+rng_stir(struct rng_state *rs)
+{
+    unsigned char rnd[CHACHA_KEYSZ + CHACHA_IVSZ];
+
+    if (system_randombytes(rnd, sizeof(rnd)) == -1)
+        return -1;
+
+    if (!rs->rs_initialized || rs->rs_forkgen != rng_forkgen) {
+        chacha_keysetup(&rs->rs_chacha, rnd, rnd + CHACHA_KEYSZ);
+        rs->rs_initialized = 1;
+        rs->rs_forkgen = rng_forkgen;
+    } else {
+        rng_rekey(rs, rnd, sizeof(rnd));
+    }
+    rng_wipe(rnd, sizeof(rnd));
+
+    /* Invalidate the buffer. */
+    rs->rs_have = 0;
+    memset(rs->rs_buf, 0, sizeof(rs->rs_buf));
+    rs->rs_count = RNG_RESEED;
+
+    return 0;
+}
+
+
+static int
+rng_randombytes(void *buf, size_t n)
+{
+    struct rng_state *rs;
+    unsigned char *p, *ks;
+    size_t m;
+
+    rs = rng_get();
+    if (rs == NULL)
+        return -1;
+
+    if (!rs->rs_initialized || rs->rs_forkgen != rng_forkgen ||
+        rs->rs_count <= n) {
+        if (rng_stir(rs) == -1)
+            return -1;
+    }
+    rs->rs_count = (rs->rs_count <= n) ? 0 : rs->rs_count - n;
+
+    p = buf;
+    while (n > 0) {
+        if (rs->rs_have > 0) {
+            m = (n < rs->rs_have) ? n : rs->rs_have;
+            ks = rs->rs_buf + sizeof(rs->rs_buf) - rs->rs_have;
+            memcpy(p, ks, m);
+            memset(ks, 0, m);
+            p += m;
+            n -= m;
+            rs->rs_have -= m;
+        }
+        if (rs->rs_have == 0)
+            rng_rekey(rs, NULL, 0);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Fill the buffer <buf> of size <n> with random data from the selected
+ * random engine.
+ */
+static inline int
+fill_randombytes(void *buf, size_t n)
+{
+    rng_stats.random_bytes += n;
+    rng_stats.random_calls++;
+
+    if (rng_engine == NANOID_ENGINE_CHACHA)
+        return rng_randombytes(buf, n);
+    else
+        return system_randombytes(buf, n);
+}
+
+
+int
+nanoid_set_engine(int engine)
+{
+    switch (engine) {
+    case NANOID_ENGINE_SYSTEM:
+    case NANOID_ENGINE_CHACHA:
+        rng_engine = engine;
+        return 0;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+
+int
+nanoid_get_engine(void)
+{
+    return rng_engine;
+}
+
+
+/*
+ * Internal, not declared in nanoid.h: only exported for the Lua bindings
+ * (nanoid_lua.c and the FFI module nanoid.lua), which keep a reserve of
+ * pre-generated IDs across calls.  Returns a pointer to the counter
+ * incremented in the child at every fork(); they compare it on every
+ * call, a plain memory load, and drop the reserve when it changes.
+ */
+const volatile unsigned int *
+nanoid_fork_generation(void)
+{
+    pthread_once(&rng_once, rng_init_once);
+    return &rng_forkgen;
+}
+
+
+void
+nanoid_get_stats(struct nanoid_stats *st)
+{
+    *st = rng_stats;
+}
+
+
+void
+nanoid_reset_stats(void)
+{
+    memset(&rng_stats, 0, sizeof(rng_stats));
+}
+
+
+/*
+ * Precompiled alphabet context.
+ *
+ * The random byte is masked with the smallest (2^n - 1) mask covering the
+ * alphabet, instead of using 'random % alphacnt', to ensure a uniform
+ * distribution; bytes falling outside the alphabet are rejected.
+ * See: https://github.com/ai/nanoid#security
+ *
+ * A context created by nanoid_ctx_new() also folds the mask and rejection
+ * into a 256-entry table mapping every random byte to its symbol, or to
+ * SYMBOL_REJECT.  The one-shot nanoid_generate_r() with a custom alphabet
+ * skips the table, which would cost more to build than it saves.
+ *
+ * Alternatively, the digits sampler (NANOID_SAMPLER_DIGITS) extracts
+ * several symbols from every 64-bit random word <w>: with M = N^k (N the
+ * alphabet size), the word is rejected as in Lemire's multiply-shift
+ * method if the low half of (w * M) is below (2^64 mod M), so that the
+ * high half is uniform in [0, M).  Its k base-N digits are then extracted
+ * by repeatedly multiplying <w> by N and taking the high half.  The <k>
+ * giving the least random bytes per symbol is chosen once.
+ * See: https://arxiv.org/abs/1805.10941
+ *
+ * For an alphabet whose size is a power of 2, the bits sampler
+ * (NANOID_SAMPLER_BITS) slices the random stream into exact
+ * log2(alphacnt)-bit fields, without any rejection; e.g., a default ID
+ * takes exactly 16 bytes (126 bits).
+ */
+
+#define SYMBOL_REJECT   0x100
+#define REFILL_MAX      4096 /* largest random data refill, in bytes */
+
+struct nanoid_ctx {
+    size_t          len; /* ID length */
+    size_t          alphacnt;
+    uint32_t        mask;
+    unsigned int    bits; /* log2(alphacnt) if a power of 2; otherwise 0 */
+    int             sampler;
+    unsigned int    ndigits; /* digits (k) extracted from every word */
+    uint64_t        dmod; /* N^k */
+    uint64_t        dthresh; /* word rejection threshold: 2^64 mod N^k */
+    uint32_t        accept; /* acceptance rate of a unit, in 1/2^32 */
+    size_t          budget; /* random bytes refilled for one ID */
+    int             has_map;
+    uint16_t        map[256]; /* random byte -> symbol or SYMBOL_REJECT */
+    unsigned char   alphabet[256]; /* padded to cover any masked byte */
+};
+
+static struct nanoid_ctx default_ctx;
+static unsigned char default_member[256]; /* membership table */
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Size of the random data refill to generate <nsym> symbols.
+ *
+ * The bits sampler needs exactly (nsym * bits) bits.  The other samplers
+ * draw units (bytes or 64-bit words) accepted with the rate p; to get the
+ * <m> accepted units, the number of draws has a mean of m/p and a standard
+ * deviation of sqrt(m * (1-p)) / p, and the refill covers 2 standard
+ * deviations above the mean, so a second refill is rarely needed.
+ *
+ * The result is a multiple of 8 and at most REFILL_MAX; a larger request
+ * is served by several refills, each split by the random engine into the
+ * maximal chunks allowed by the random source (e.g., 256 bytes for
+ * getentropy()).
+ */
+static size_t
+ctx_budget(const struct nanoid_ctx *ctx, size_t nsym)
+{
+    uint64_t p;
+    size_t m, unit, n;
+
+    if (nsym > REFILL_MAX * 8)
+        return REFILL_MAX;
+
+    if (ctx->sampler == NANOID_SAMPLER_BITS) {
+        n = (nsym * ctx->bits + 63) / 64 * 8;
+    } else {
+        if (ctx->sampler == NANOID_SAMPLER_DIGITS) {
+            m = (nsym + ctx->ndigits - 1) / ctx->ndigits;
+            unit = 8;
+        } else {
+            m = nsym;
+            unit = 1;
+        }
+        /* Fixed point with 16 fraction bits: p in (0, 1] */
+        p = (ctx->accept >> 16) + 1;
+        n = (m << 16) + 2 * (isqrt_up(m * ((1U << 16) - (size_t)p)) << 8);
+        n = (size_t)((n + p - 1) / p) * unit;
+        n = (n + 7) & ~(size_t)7;
+    }
+
+    return (n > REFILL_MAX) ? REFILL_MAX : n;
+}
+
+
+/*
+ * Set up the sampler <sampler> and the random data cost of <ctx>.
+ */
+static int
+ctx_set_sampler(struct nanoid_ctx *ctx, int sampler)
+{
+    const double two64 = 18446744073709551616.0;
+    uint64_t m, best_m, lo;
+    double c, best_c;
+    unsigned int k;
+
+    switch (sampler) {
+    case NANOID_SAMPLER_MASK:
+        ctx->accept = (uint32_t)(((uint64_t)ctx->alphacnt << 32) /
+                                 (ctx->mask + 1) - 1);
+        break;
+
+    case NANOID_SAMPLER_BITS:
+        if (ctx->bits == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        ctx->accept = UINT32_MAX;
+        break;
+
+    case NANOID_SAMPLER_DIGITS:
+        best_c = 8.0;
+        best_m = ctx->alphacnt;
+        ctx->ndigits = 1;
+        for (k = 1, m = ctx->alphacnt; ; ++k) {
+            /* bytes per symbol = 8 / (k * acceptance) */
+            c = 8.0 / (k * (1.0 - (double)((0 - m) % m) / two64));
+            if (c < best_c) {
+                best_c = c;
+                best_m = m;
+                ctx->ndigits = k;
+            }
+            if (mul64(m, ctx->alphacnt, &lo) != 0)
+                break; /* N^(k+1) overflows */
+            m = lo;
+        }
+        ctx->dmod = best_m;
+        ctx->dthresh = (0 - best_m) % best_m;
+        ctx->accept = (ctx->dthresh == 0) ? UINT32_MAX :
+                      (uint32_t)((0 - ctx->dthresh) >> 32);
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->sampler = sampler;
+    ctx->budget = ctx_budget(ctx, ctx->len);
+    return 0;
+}
+
+
+static int
+ctx_init(struct nanoid_ctx *ctx, const unsigned char *alphabet,
+         size_t alphacnt, size_t len, int with_map)
+{
+    size_t i, ai;
+
+    if (alphabet == NULL) {
+        alphabet = default_alphabet;
+        alphacnt = sizeof(default_alphabet) - 1;
+    }
+
+    if (alphacnt <= 1 || alphacnt >= 256) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->len = len;
+    ctx->alphacnt = alphacnt;
+    ctx->mask = roundup2((uint32_t)alphacnt) - 1;
+    ctx->bits = 0;
+    if (alphacnt == ctx->mask + 1) {
+        while ((1U << ctx->bits) < alphacnt)
+            ctx->bits++;
+    }
+    ctx_set_sampler(ctx, NANOID_SAMPLER_MASK);
+    memcpy(ctx->alphabet, alphabet, alphacnt);
+    memset(ctx->alphabet + alphacnt, 0, sizeof(ctx->alphabet) - alphacnt);
+
+    ctx->has_map = with_map;
+    if (with_map) {
+        for (i = 0; i < 256; ++i) {
+            ai = i & ctx->mask;
+            ctx->map[i] = (ai < alphacnt) ? alphabet[ai] : SYMBOL_REJECT;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * The default alphabet has 64 symbols, so its IDs take exact 6-bit fields
+ * of the random data.
+ */
+static void
+default_ctx_init(void)
+{
+    size_t i;
+
+    ctx_init(&default_ctx, NULL, 0, NANOID_SIZE, 1);
+    ctx_set_sampler(&default_ctx, NANOID_SAMPLER_BITS);
+    for (i = 0; i < sizeof(default_alphabet) - 1; ++i)
+        default_member[default_alphabet[i]] = 1;
+}
+
+
+static inline const struct nanoid_ctx *
+default_ctx_get(void)
+{
+    pthread_once(&default_once, default_ctx_init);
+    return &default_ctx;
+}
+
+
+/*
+ * Map the random bytes <src> of length <srclen> to at most <dstlen>
+ * symbols stored into <dst>.
+ * Returns the number of symbols stored, and sets <*used> to the number of
+ * random bytes consumed.
+ *
+ * Both variants always store the symbol but only advance on an accepted
+ * byte, so there is no branch on the random data.
+ */
+static size_t
+map_table(const struct nanoid_ctx *ctx, unsigned char *dst, size_t dstlen,
+          const unsigned char *src, size_t srclen, size_t *used)
+{
+    size_t i, j;
+    unsigned int v;
+
+    for (i = 0, j = 0; i < srclen && j < dstlen; ++i) {
+        v = ctx->map[src[i]];
+        dst[j] = (unsigned char)v;
+        j += (v >> 8) ^ 1;
+    }
+
+    *used = i;
+    return j;
+}
+
+
+static size_t
+map_mask(const struct nanoid_ctx *ctx, unsigned char *dst, size_t dstlen,
+         const unsigned char *src, size_t srclen, size_t *used)
+{
+    size_t i, j, ai;
+
+    for (i = 0, j = 0; i < srclen && j < dstlen; ++i) {
+        ai = src[i] & ctx->mask;
+        dst[j] = ctx->alphabet[ai];
+        j += (ai < ctx->alphacnt);
+    }
+
+    *used = i;
+    return j;
+}
+
+
+/*
+ * Symbol mapping kernels, selected at load time according to the CPU
+ * features; the last supported one in the list wins.
+ */
+
+struct map_kernel {
+    const char  *name;
+    uint32_t    maxmask; /* largest alphabet mask supported */
+    size_t      (*map)(const unsigned char *alphabet, size_t alphacnt,
+                       uint32_t mask, unsigned char *dst, size_t dstlen,
+                       const unsigned char *src, size_t srclen,
+                       size_t *used);
+    int         (*supported)(void);
+    /* validation of >= 32 bytes of the default alphabet */
+    int         (*validate)(const unsigned char *s, size_t len);
+    /* packing of 64-symbol alphabets */
+    size_t      (*pack6)(const unsigned char *rev, unsigned char *dst,
+                         const unsigned char *src, size_t len,
+                         unsigned int *bad);
+    size_t      (*unpack6)(const unsigned char *alphabet, unsigned char *dst,
+                           size_t len, const unsigned char *src,
+                           size_t srclen);
+};
+
+static const struct map_kernel map_kernels[] = {
+    { "scalar", 0, NULL, NULL, NULL, NULL, NULL },
+#ifdef HAVE_SIMD_X86
+    { "ssse3", 63, simd_map_ssse3, simd_have_ssse3, simd_validate_sse2,
+      simd_pack6_ssse3, simd_unpack6_ssse3 },
+    { "avx2", 63, simd_map_avx2, simd_have_avx2, simd_validate_avx2,
+      simd_pack6_avx2, simd_unpack6_avx2 },
+    { "avx512", 255, simd_map_avx512, simd_have_avx512, simd_validate_avx2,
+      simd_pack6_avx512, simd_unpack6_avx512 },
+#endif
+};
+
+static const struct map_kernel *map_kernel = &map_kernels[0];
+
+#ifdef HAVE_SIMD_X86
+__attribute__((constructor))
+static void
+map_kernel_init(void)
+{
+    size_t i;
+
+    simd_init();
+    for (i = 1; i < sizeof(map_kernels) / sizeof(map_kernels[0]); ++i) {
+        if (map_kernels[i].supported())
+            map_kernel = &map_kernels[i];
+    }
+}
+#endif
+
+
+static inline size_t
+ctx_map(const struct nanoid_ctx *ctx, unsigned char *dst, size_t dstlen,
+        const unsigned char *src, size_t srclen, size_t *used)
+{
+    const struct map_kernel *k = map_kernel;
+    size_t i = 0, j = 0, u;
+
+    if (k->map != NULL && ctx->mask <= k->maxmask) {
+        j = k->map(ctx->alphabet, ctx->alphacnt, ctx->mask, dst, dstlen,
+                   src, srclen, &i);
+    }
+
+    if (ctx->has_map)
+        j += map_table(ctx, dst + j, dstlen - j, src + i, srclen - i, &u);
+    else
+        j += map_mask(ctx, dst + j, dstlen - j, src + i, srclen - i, &u);
+
+    *used = i + u;
+    return j;
+}
+
+
+int
+nanoid_set_kernel(const char *name)
+{
+    const struct map_kernel *k;
+    size_t i;
+
+    if (name == NULL || strcmp(name, "auto") == 0) {
+#ifdef HAVE_SIMD_X86
+        map_kernel_init();
+#endif
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(map_kernels) / sizeof(map_kernels[0]); ++i) {
+        k = &map_kernels[i];
+        if (strcmp(name, k->name) != 0)
+            continue;
+        if (k->supported != NULL && !k->supported()) {
+            errno = ENOTSUP;
+            return -1;
+        }
+        map_kernel = k;
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+const char *
+nanoid_get_random_source(void)
+{
+    if (rng_source.fn == source_auto)
+        return randombytes_source();
+    return rng_source.name;
+}
+
+
+const char *
+nanoid_get_kernel(void)
+{
+    return map_kernel->name;
+}
+
+
+/*
+ * Size of the next random data refill for the remaining <count> IDs of
+ * length <len>, of which the first one already has <done> symbols.
+ */
+static inline size_t
+ctx_refill(const struct nanoid_ctx *ctx, size_t count, size_t len,
+           size_t done)
+{
+    if (count == 1 && len == ctx->len && done == 0)
+        return ctx->budget;
+    else if (count > REFILL_MAX * 8 || len > REFILL_MAX * 8)
+        return REFILL_MAX;
+    else
+        return ctx_budget(ctx, len * count - done);
+}
+
+
+/*
+ * Generate <count> IDs of length <len> into <buf> at the given <stride>
+ * with the digits sampler, carrying the unused digits of a word across
+ * the ID boundaries.
+ */
+static void *
+fill_digits(const struct nanoid_ctx *ctx, void *buf, size_t count,
+            size_t len, size_t stride, int flags)
+{
+    uint64_t words[REFILL_MAX / sizeof(uint64_t)];
+    uint64_t w, lo, d;
+    unsigned char *p;
+    size_t nwords, pos, n, j;
+    unsigned int left;
+
+    nwords = pos = 0;
+    left = 0;
+    w = 0;
+
+    for (n = 0, p = buf; n < count; ++n, p += stride) {
+        for (j = 0; j < len; ++j) {
+            while (left == 0) {
+                if (pos == nwords) {
+                    nwords = ctx_refill(ctx, count - n, len, j) / sizeof(w);
+                    if (fill_randombytes(words, nwords * sizeof(w)) == -1)
+                        return NULL;
+                    pos = 0;
+                }
+                w = words[pos++];
+                mul64(w, ctx->dmod, &lo);
+                if (lo >= ctx->dthresh)
+                    left = ctx->ndigits;
+            }
+            d = mul64(w, ctx->alphacnt, &w);
+            p[j] = ctx->alphabet[d];
+            left--;
+        }
+        if (flags & NANOID_BATCH_NUL)
+            p[len] = '\0';
+    }
+
+    return buf;
+}
+
+
+/*
+ * Generate <count> IDs of length <len> into <buf> at the given <stride>
+ * with the bits sampler, reading the random data as a stream of 64-bit
+ * words and carrying the unused bits across the ID boundaries.
+ */
+static void *
+fill_bits(const struct nanoid_ctx *ctx, void *buf, size_t count,
+          size_t len, size_t stride, int flags)
+{
+    uint64_t words[REFILL_MAX / sizeof(uint64_t)];
+    uint64_t acc, w;
+    unsigned char *p;
+    size_t nwords, pos, n, j;
+    unsigned int bits, nbits;
+
+    bits = ctx->bits;
+    nwords = pos = 0;
+    acc = 0;
+    nbits = 0;
+
+    for (n = 0, p = buf; n < count; ++n, p += stride) {
+        for (j = 0; j < len; ++j) {
+            if (nbits >= bits) {
+                p[j] = ctx->alphabet[acc & ctx->mask];
+                acc >>= bits;
+                nbits -= bits;
+                continue;
+            }
+
+            if (pos == nwords) {
+                nwords = ctx_refill(ctx, count - n, len, j) / sizeof(w);
+                if (fill_randombytes(words, nwords * sizeof(w)) == -1)
+                    return NULL;
+                pos = 0;
+            }
+            /* Take the low bits left in <acc>, and the rest from <w>. */
+            w = words[pos++];
+            p[j] = ctx->alphabet[(acc | (w << nbits)) & ctx->mask];
+            acc = w >> (bits - nbits);
+            nbits = 64 - (bits - nbits);
+        }
+        if (flags & NANOID_BATCH_NUL)
+            p[len] = '\0';
+    }
+
+    return buf;
+}
+
+
+/*
+ * Generate <count> IDs of length <len> into <buf> at the given <stride>,
+ * consuming all the accepted random bytes across the ID boundaries.
+ */
+static void *
+ctx_fill(const struct nanoid_ctx *ctx, void *buf, size_t count, size_t len,
+         size_t stride, int flags)
+{
+    unsigned char bytes[REFILL_MAX];
+    unsigned char *p;
+    size_t refill, pos, used, n, j;
+
+    if (ctx->sampler == NANOID_SAMPLER_BITS)
+        return fill_bits(ctx, buf, count, len, stride, flags);
+    if (ctx->sampler == NANOID_SAMPLER_DIGITS)
+        return fill_digits(ctx, buf, count, len, stride, flags);
+
+    refill = pos = 0;
+
+    for (n = 0, p = buf; n < count; ++n, p += stride) {
+        for (j = 0; j < len; ) {
+            if (pos == refill) {
+                refill = ctx_refill(ctx, count - n, len, j);
+                if (fill_randombytes(bytes, refill) == -1)
+                    return NULL;
+                pos = 0;
+            }
+            j += ctx_map(ctx, p + j, len - j, bytes + pos, refill - pos,
+                         &used);
+            pos += used;
+        }
+        if (flags & NANOID_BATCH_NUL)
+            p[len] = '\0';
+    }
+
+    return buf;
+}
+
+
+/*
+ * Check the batch <flags> and resolve the <stride> for IDs of length <len>.
+ */
+static int
+batch_stride(size_t len, size_t *stride, int flags)
+{
+    size_t idsize;
+
+    if ((flags & ~NANOID_BATCH_NUL) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    idsize = len + ((flags & NANOID_BATCH_NUL) ? 1 : 0);
+    if (*stride == 0) {
+        *stride = idsize;
+    } else if (*stride < idsize) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+struct nanoid_ctx *
+nanoid_ctx_new(const unsigned char *alphabet, size_t alphacnt, size_t len)
+{
+    struct nanoid_ctx *ctx;
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+
+    if (ctx_init(ctx, alphabet, alphacnt, len, 1) == -1) {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+
+void
+nanoid_ctx_free(struct nanoid_ctx *ctx)
+{
+    free(ctx);
+}
+
+
+int
+nanoid_ctx_set_sampler(struct nanoid_ctx *ctx, int sampler)
+{
+    return ctx_set_sampler(ctx, sampler);
+}
+
+
+void *
+nanoid_ctx_generate(const struct nanoid_ctx *ctx, void *buf)
+{
+    return ctx_fill(ctx, buf, 1, ctx->len, ctx->len, 0);
+}
+
+
+void *
+nanoid_ctx_generate_batch(const struct nanoid_ctx *ctx, void *buf,
+                          size_t count, size_t stride, int flags)
+{
+    if (batch_stride(ctx->len, &stride, flags) == -1)
+        return NULL;
+
+    return ctx_fill(ctx, buf, count, ctx->len, stride, flags);
+}
+
+
+void *
+nanoid_generate_r(void *buf, size_t buflen, const unsigned char *alphabet,
+                  size_t alphacnt)
+{
+    struct nanoid_ctx ctx;
+
+    if (alphabet == NULL)
+        return ctx_fill(default_ctx_get(), buf, 1, buflen, buflen, 0);
+
+    if (ctx_init(&ctx, alphabet, alphacnt, buflen, 0) == -1)
+        return NULL;
+
+    return ctx_fill(&ctx, buf, 1, buflen, buflen, 0);
+}
+
+
+void *
+nanoid_generate_batch(void *buf, size_t count, size_t len, size_t stride,
+                      int flags, const unsigned char *alphabet,
+                      size_t alphacnt)
+{
+    struct nanoid_ctx ctx;
+
+    if (batch_stride(len, &stride, flags) == -1)
+        return NULL;
+
+    if (alphabet == NULL)
+        return ctx_fill(default_ctx_get(), buf, count, len, stride, flags);
+
+    if (ctx_init(&ctx, alphabet, alphacnt, len, 0) == -1)
+        return NULL;
+
+    return ctx_fill(&ctx, buf, count, len, stride, flags);
+}
+
+
+const char *
+nanoid_generate(const unsigned char *alphabet, size_t alphacnt)
+{
+    static char buf[NANOID_SIZE + 1];
+
+    if (nanoid_generate_r(buf, NANOID_SIZE, alphabet, alphacnt) == NULL)
+        return NULL;
+
+    buf[NANOID_SIZE] = '\0';
+    return buf;
+}
+
+
+/*
+ * Validation: every byte is looked up in a 256-entry membership table of
+ * the alphabet, without branches on the data; the default alphabet is
+ * checked with the SIMD range compares of the current kernel.
+ *
+ * A byte table rather than a 256-bit bitmap: it is built with plain
+ * stores, while setting bits is a chain of read-modify-writes to the same
+ * words, and checked without variable shifts.
+ */
+static int
+member_init(unsigned char member[256], const unsigned char *alphabet,
+            size_t alphacnt)
+{
+    size_t i;
+
+    if (alphacnt <= 1 || alphacnt >= 256) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(member, 0, 256);
+    for (i = 0; i < alphacnt; ++i)
+        member[alphabet[i]] = 1;
+
+    return 0;
+}
+
+
+static inline int
+member_check(const unsigned char member[256], const unsigned char *s,
+             size_t len)
+{
+    unsigned int ok = 1;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        ok &= member[s[i]];
+
+    return (int)ok;
+}
+
+
+static inline int
+validate_default(const unsigned char *s, size_t len)
+{
+#ifdef HAVE_SIMD_X86
+    if (len >= 16 && map_kernel->validate != NULL) {
+        /* Shorter strings stay on SSE2 to avoid the AVX2 state switch. */
+        if (len >= 32)
+            return map_kernel->validate(s, len);
+        return simd_validate_sse2(s, len);
+    }
+#endif
+
+    pthread_once(&default_once, default_ctx_init);
+    return member_check(default_member, s, len);
+}
+
+
+int
+nanoid_validate(const void *str, size_t len, const unsigned char *alphabet,
+                size_t alphacnt)
+{
+    unsigned char member[256];
+
+    if (alphabet == NULL)
+        return validate_default(str, len);
+
+    if (member_init(member, alphabet, alphacnt) == -1)
+        return -1;
+
+    return member_check(member, str, len);
+}
+
+
+int
+nanoid_validate_batch(const void *buf, size_t count, size_t len,
+                      size_t stride, const unsigned char *alphabet,
+                      size_t alphacnt, unsigned char *valid)
+{
+    const unsigned char *p = buf;
+    unsigned char member[256];
+    size_t i;
+    int v, all = 1;
+
+    if (stride == 0)
+        stride = len;
+    if (stride < len) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (alphabet != NULL &&
+        member_init(member, alphabet, alphacnt) == -1)
+        return -1;
+
+    for (i = 0; i < count; ++i, p += stride) {
+        if (alphabet == NULL)
+            v = validate_default(p, len);
+        else
+            v = member_check(member, p, len);
+        if (valid != NULL)
+            valid[i] = (unsigned char)v;
+        all &= v;
+    }
+
+    return all;
+}
+
+
+/*
+ * Packing: the IDs of an alphabet whose size is a power of 2 (2^b) are
+ * stored as the bit string of their symbol indexes, b bits per symbol, the
+ * first symbol in the high bits of the first byte, and the last byte
+ * padded with zero bits; e.g., a default ID packs into 16 bytes (126 bits
+ * and 2 pad bits).  Packed IDs compare (memcmp) in the order of their
+ * index strings, which is the bytewise order of the text form for an
+ * ascending alphabet (e.g., of the sortable IDs).
+ *
+ * 64-symbol alphabets of ASCII symbols are converted by the SIMD kernels
+ * 16 or more symbols at a time; the rest is done with a bit accumulator.
+ */
+#define PACK_INVALID    0xff /* reverse table entry of a non-symbol */
+
+struct pack_table {
+    unsigned int    bits; /* bits per symbol */
+    int             simd; /* 64 ASCII symbols: the SIMD kernels apply */
+    const unsigned char *alphabet;
+    unsigned char   rev[256]; /* symbol -> index, or PACK_INVALID */
+};
+
+static struct pack_table default_pack;
+static pthread_once_t default_pack_once = PTHREAD_ONCE_INIT;
+
+
+static int
+pack_init(struct pack_table *pt, const unsigned char *alphabet,
+          size_t alphacnt)
+{
+    size_t i;
+    int ascii = 1;
+
+    if (alphabet == NULL) {
+        alphabet = default_alphabet;
+        alphacnt = sizeof(default_alphabet) - 1;
+    }
+
+    if (alphacnt <= 1 || alphacnt >= 256 ||
+        (alphacnt & (alphacnt - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (pt->bits = 0; (1U << pt->bits) < alphacnt; pt->bits++)
+        ;
+    pt->alphabet = alphabet;
+    memset(pt->rev, PACK_INVALID, sizeof(pt->rev));
+    for (i = 0; i < alphacnt; ++i) {
+        pt->rev[alphabet[i]] = (unsigned char)i;
+        ascii &= (alphabet[i] < 128);
+    }
+    pt->simd = (pt->bits == 6 && ascii);
+
+    return 0;
+}
+
+
+static void
+default_pack_init(void)
+{
+    pack_init(&default_pack, NULL, 0);
+}
+
+
+static const struct pack_table *
+pack_get(struct pack_table *tmp, const unsigned char *alphabet,
+         size_t alphacnt)
+{
+    if (alphabet == NULL) {
+        pthread_once(&default_pack_once, default_pack_init);
+        return &default_pack;
+    }
+
+    if (pack_init(tmp, alphabet, alphacnt) == -1)
+        return NULL;
+    return tmp;
+}
+
+
+static inline size_t
+pack_size(const struct pack_table *pt, size_t len)
+{
+    return (len * pt->bits + 7) / 8;
+}
+
+
+/*
+ * Pack the symbols <s> of length <len> into <dst>.
+ * Returns 0 on success, or -1 if any of them isn't a symbol.
+ */
+static int
+pack_one(const struct pack_table *pt, unsigned char *dst,
+         const unsigned char *s, size_t len)
+{
+    const struct map_kernel *k = map_kernel;
+    uint64_t acc = 0;
+    size_t i = 0;
+    unsigned int v, bad = 0, nbits = 0, bits = pt->bits;
+
+    if (pt->simd && k->pack6 != NULL) {
+        i = k->pack6(pt->rev, dst, s, len, &bad);
+        dst += i / 4 * 3;
+    }
+
+    for (; i < len; ++i) {
+        v = pt->rev[s[i]];
+        bad |= v;
+        acc = (acc << bits) | v;
+        nbits += bits;
+        if (nbits >= 8) {
+            nbits -= 8;
+            *dst++ = (unsigned char)(acc >> nbits);
+        }
+    }
+    if (nbits > 0)
+        *dst = (unsigned char)(acc << (8 - nbits));
+
+    if (bad & 0x80) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Unpack <len> symbols from <src> into <dst>.
+ * Returns 0 on success, or -1 if the pad bits aren't zero.
+ */
+static int
+unpack_one(const struct pack_table *pt, unsigned char *dst, size_t len,
+           const unsigned char *src)
+{
+    const struct map_kernel *k = map_kernel;
+    uint64_t acc = 0;
+    size_t j = 0, size = pack_size(pt, len);
+    unsigned int nbits = 0, bits = pt->bits;
+    unsigned int mask = (1U << bits) - 1, pad = (unsigned int)(size * 8 -
+                                                             len * bits);
+
+    if (pad > 0 && (src[size - 1] & ((1U << pad) - 1)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pt->simd && k->unpack6 != NULL) {
+        j = k->unpack6(pt->alphabet, dst, len, src, size);
+        src += j / 4 * 3;
+    }
+
+    for (; j < len; ++j) {
+        if (nbits < bits) {
+            acc = (acc << 8) | *src++;
+            nbits += 8;
+        }
+        nbits -= bits;
+        dst[j] = pt->alphabet[(acc >> nbits) & mask];
+    }
+
+    return 0;
+}
+
+
+size_t
+nanoid_packed_size(size_t len, const unsigned char *alphabet,
+                   size_t alphacnt)
+{
+    const struct pack_table *pt;
+    struct pack_table tmp;
+
+    pt = pack_get(&tmp, alphabet, alphacnt);
+    if (pt == NULL)
+        return 0;
+
+    return pack_size(pt, len);
+}
+
+
+void *
+nanoid_pack(void *dst, const void *id, size_t len,
+            const unsigned char *alphabet, size_t alphacnt)
+{
+    const struct pack_table *pt;
+    struct pack_table tmp;
+
+    pt = pack_get(&tmp, alphabet, alphacnt);
+    if (pt == NULL || pack_one(pt, dst, id, len) == -1)
+        return NULL;
+
+    return dst;
+}
+
+
+void *
+nanoid_unpack(void *buf, size_t len, const void *src,
+              const unsigned char *alphabet, size_t alphacnt)
+{
+    const struct pack_table *pt;
+    struct pack_table tmp;
+
+    pt = pack_get(&tmp, alphabet, alphacnt);
+    if (pt == NULL || unpack_one(pt, buf, len, src) == -1)
+        return NULL;
+
+    return buf;
+}
+
+
+void *
+nanoid_pack_batch(void *dst, const void *ids, size_t count, size_t len,
+                  size_t stride, const unsigned char *alphabet,
+                  size_t alphacnt)
+{
+    const struct pack_table *pt;
+    struct pack_table tmp;
+    const unsigned char *s = ids;
+    unsigned char *p = dst;
+    size_t i, size;
+
+    if (stride == 0)
+        stride = len;
+    if (stride < len) {
+        errno = EINVAL;
+        return NULL;
+    }
+    pt = pack_get(&tmp, alphabet, alphacnt);
+    if (pt == NULL)
+        return NULL;
+
+    size = pack_size(pt, len);
+    for (i = 0; i < count; ++i, s += stride, p += size) {
+        if (pack_one(pt, p, s, len) == -1)
+            return NULL;
+    }
+
+    return dst;
+}
+
+
+void *
+nanoid_unpack_batch(void *buf, size_t count, size_t len, size_t stride,
+                    int flags, const void *src,
+                    const unsigned char *alphabet, size_t alphacnt)
+{
+    const struct pack_table *pt;
+    struct pack_table tmp;
+    const unsigned char *s = src;
+    unsigned char *p = buf;
+    size_t i, size;
+
+    if (batch_stride(len, &stride, flags) == -1)
+        return NULL;
+    pt = pack_get(&tmp, alphabet, alphacnt);
+    if (pt == NULL)
+        return NULL;
+
+    size = pack_size(pt, len);
+    for (i = 0; i < count; ++i, s += size, p += stride) {
+        if (unpack_one(pt, p, len, s) == -1)
+            return NULL;
+        if (flags & NANOID_BATCH_NUL)
+            p[len] = '\0';
+    }
+
+    return buf;
+}
+
+
+/*
+ * Sortable IDs: the prefix encodes a 60-bit sequence value made of the
+ * Unix time in milliseconds (48 bits) and a counter within the same
+ * millisecond (12 bits), as fixed-width base-N digits of an alphabet in
+ * ascending byte order; the rest of the ID is random.
+ *
+ * The sequence value is process-wide and strictly increasing: on a counter
+ * overflow, or if the clock steps back, it keeps counting into the next
+ * millisecond, so IDs of a process always sort in generation order.
+ */
+#define SORTABLE_SEQ_BITS   12
+#define SORTABLE_BITS       (48 + SORTABLE_SEQ_BITS)
+
+/* Alphabet: base64url symbols in ascending ASCII order */
+static const unsigned char sortable_alphabet[] = NANOID_SORTABLE_ALPHABET;
+
+static uint64_t sortable_seq;
+static struct nanoid_ctx sortable_ctx;
+static pthread_once_t sortable_once = PTHREAD_ONCE_INIT;
+
+
+static void
+sortable_ctx_init(void)
+{
+    ctx_init(&sortable_ctx, sortable_alphabet,
+             sizeof(sortable_alphabet) - 1, NANOID_SIZE, 1);
+    ctx_set_sampler(&sortable_ctx, NANOID_SAMPLER_BITS);
+}
+
+
+/*
+ * Number of digits of the context's alphabet covering the sequence value.
+ */
+static size_t
+sortable_width(const struct nanoid_ctx *ctx)
+{
+    size_t w = 0;
+    uint64_t v = (uint64_t)1 << SORTABLE_BITS;
+
+    if (ctx->bits > 0)
+        return (SORTABLE_BITS + ctx->bits - 1) / ctx->bits;
+
+    while (v > 1) {
+        v = (v + ctx->alphacnt - 1) / ctx->alphacnt;
+        w++;
+    }
+
+    return w;
+}
+
+
+/*
+ * Return the next sequence value.
+ */
+static uint64_t
+sortable_next(void)
+{
+    struct timespec ts;
+    uint64_t now, cur, next;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    now = (now << SORTABLE_SEQ_BITS) & (((uint64_t)1 << SORTABLE_BITS) - 1);
+
+    cur = __atomic_load_n(&sortable_seq, __ATOMIC_RELAXED);
+    do {
+        next = (cur >= now) ? cur + 1 : now;
+    } while (!__atomic_compare_exchange_n(&sortable_seq, &cur, next, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    return next;
+}
+
+
+void *
+nanoid_generate_sortable(void *buf, size_t buflen,
+                         const unsigned char *alphabet, size_t alphacnt)
+{
+    const struct nanoid_ctx *ctx;
+    struct nanoid_ctx tmp;
+    unsigned char *p = buf;
+    uint64_t v;
+    size_t width, i;
+
+    if (alphabet == NULL) {
+        pthread_once(&sortable_once, sortable_ctx_init);
+        ctx = &sortable_ctx;
+    } else {
+        if (ctx_init(&tmp, alphabet, alphacnt, buflen, 0) == -1)
+            return NULL;
+        for (i = 1; i < alphacnt; ++i) {
+            if (alphabet[i - 1] >= alphabet[i]) {
+                errno = EINVAL;
+                return NULL;
+            }
+        }
+        ctx = &tmp;
+    }
+
+    width = sortable_width(ctx);
+    if (buflen <= width) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    v = sortable_next();
+    if (ctx->bits > 0) {
+        for (i = width; i > 0; --i) {
+            p[i - 1] = ctx->alphabet[v & ctx->mask];
+            v >>= ctx->bits;
+        }
+    } else {
+        for (i = width; i > 0; --i) {
+            p[i - 1] = ctx->alphabet[v % ctx->alphacnt];
+            v /= ctx->alphacnt;
+        }
+    }
+
+    if (ctx_fill(ctx, p + width, 1, buflen - width, buflen - width, 0)
+            == NULL)
+        return NULL;
+
+    return buf;
+}
+
+
+/*
+ * ID pool: a bounded lock-free MPMC ring of ready-made IDs (Dmitry Vyukov's
+ * bounded queue), refilled by a background thread whenever the number of
+ * ready IDs drops to the low watermark.
+ * Credit: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Every slot carries a sequence number: slot i is free for the enqueue
+ * position p when seq == p, and ready for the dequeue position p when
+ * seq == p + 1.  Taking an ID is a CAS on the dequeue position plus a
+ * copy; only waking up the refill thread takes the lock, once per cycle.
+ */
+#define POOL_CACHELINE  64
+#define POOL_BATCH      64 /* IDs generated per batch by the refill thread */
+#define POOL_BATCHSZ    16384 /* bytes of a batch, and maximum ID length */
+
+struct nanoid_pool {
+    size_t              enqueue_pos;
+    char                pad0[POOL_CACHELINE - sizeof(size_t)];
+    size_t              dequeue_pos;
+    char                pad1[POOL_CACHELINE - sizeof(size_t)];
+    int                 pending; /* refill requested */
+    int                 stop;
+    unsigned int        forkgen;
+    size_t              mask; /* capacity - 1 */
+    size_t              lowat;
+    size_t              *seq;
+    unsigned char       *ids;
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    unsigned long long  refills;
+    unsigned long long  refilled;
+    unsigned long long  underflows;
+    struct nanoid_ctx   ctx;
+};
+
+static unsigned int pool_forkgen;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+
+static void
+pool_atfork_child(void)
+{
+    pool_forkgen++;
+}
+
+
+static void
+pool_init_once(void)
+{
+    pthread_atfork(NULL, NULL, pool_atfork_child);
+}
+
+
+static inline size_t
+pool_count(const struct nanoid_pool *pool)
+{
+    size_t e = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    size_t d = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+
+    return (e > d) ? e - d : 0;
+}
+
+
+/*
+ * Wake up the refill thread, unless a refill is already requested.
+ */
+static void
+pool_wakeup(struct nanoid_pool *pool)
+{
+    if (__atomic_load_n(&pool->pending, __ATOMIC_RELAXED) != 0 ||
+        __atomic_exchange_n(&pool->pending, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Fill the ring up to its capacity.  The refill thread is the only
+ * producer, so the free slots can be claimed without a CAS.
+ */
+static void
+pool_fill(struct nanoid_pool *pool)
+{
+    unsigned char batch[POOL_BATCHSZ];
+    size_t len = pool->ctx.len;
+    size_t pos, room, n, i, slot;
+
+    for (;;) {
+        pos = pool->enqueue_pos;
+        room = pool->mask + 1 - pool_count(pool);
+        if (room == 0)
+            break;
+
+        n = sizeof(batch) / len;
+        if (n > POOL_BATCH)
+            n = POOL_BATCH;
+        if (n > room)
+            n = room;
+        if (ctx_fill(&pool->ctx, batch, n, len, len, 0) == NULL)
+            break;
+
+        for (i = 0; i < n; ++i, ++pos) {
+            slot = pos & pool->mask;
+            if (__atomic_load_n(&pool->seq[slot], __ATOMIC_ACQUIRE) != pos)
+                break; /* still being copied out by a consumer */
+            memcpy(pool->ids + slot * len, batch + i * len, len);
+            __atomic_store_n(&pool->seq[slot], pos + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&pool->enqueue_pos, pos + 1, __ATOMIC_RELEASE);
+        }
+        rng_wipe(batch, n * len);
+        __atomic_fetch_add(&pool->refilled, i, __ATOMIC_RELAXED);
+        if (i < n)
+            break;
+    }
+}
+
+
+static void *
+pool_thread(void *arg)
+{
+    struct nanoid_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        /* Clear the request first, so a concurrent one is not lost. */
+        __atomic_store_n(&pool->pending, 0, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&pool->refills, 1, __ATOMIC_RELAXED);
+        pool_fill(pool);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+struct nanoid_pool *
+nanoid_pool_new(const struct nanoid_ctx *ctx, size_t capacity, size_t lowat)
+{
+    struct nanoid_pool *pool;
+    size_t cap, i;
+    int err;
+
+    if (ctx == NULL || ctx->len == 0 || ctx->len > POOL_BATCHSZ ||
+        capacity == 0 || capacity > ((size_t)1 << 30)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (pthread_once(&pool_once, pool_init_once) != 0)
+        return NULL;
+
+    for (cap = 1; cap < capacity; cap <<= 1)
+        ;
+    if (lowat == 0 || lowat >= cap)
+        lowat = cap / 2;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+
+    pool->ctx = *ctx;
+    pool->mask = cap - 1;
+    pool->lowat = lowat;
+    pool->forkgen = pool_forkgen;
+    pool->seq = malloc(cap * sizeof(*pool->seq));
+    pool->ids = malloc(cap * ctx->len);
+    if (pool->seq == NULL || pool->ids == NULL)
+        goto fail;
+    for (i = 0; i < cap; ++i)
+        pool->seq[i] = i;
+
+    if ((err = pthread_mutex_init(&pool->lock, NULL)) != 0) {
+        errno = err;
+        goto fail;
+    }
+    if ((err = pthread_cond_init(&pool->cond, NULL)) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        errno = err;
+        goto fail;
+    }
+
+    /* Fill synchronously, so the first takes are already served. */
+    pool_fill(pool);
+
+    if ((err = pthread_create(&pool->thread, NULL, pool_thread, pool)) != 0) {
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+        errno = err;
+        goto fail;
+    }
+
+    return pool;
+
+fail:
+    if (pool->ids != NULL)
+        rng_wipe(pool->ids, cap * ctx->len);
+    free(pool->ids);
+    free(pool->seq);
+    free(pool);
+    return NULL;
+}
+
+
+void
+nanoid_pool_free(struct nanoid_pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    if (pool->forkgen == pool_forkgen) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_join(pool->thread, NULL);
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+    }
+    /* else: the refill thread does not exist in a forked child. */
+
+    rng_wipe(pool->ids, (pool->mask + 1) * pool->ctx.len);
+    free(pool->ids);
+    free(pool->seq);
+    free(pool);
+}
+
+
+void *
+nanoid_pool_take(struct nanoid_pool *pool, void *buf)
+{
+    size_t len = pool->ctx.len;
+    size_t pos, seq, slot;
+    ptrdiff_t dif;
+
+    /* The ring of a forked child holds the same IDs as its parent. */
+    if (pool->forkgen != pool_forkgen)
+        return ctx_fill(&pool->ctx, buf, 1, len, len, 0);
+
+    pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = pos & pool->mask;
+        seq = __atomic_load_n(&pool->seq[slot], __ATOMIC_ACQUIRE);
+        dif = (ptrdiff_t)(seq - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pool->dequeue_pos, &pos,
+                                            pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            /* Empty: generate synchronously. */
+            __atomic_fetch_add(&pool->underflows, 1, __ATOMIC_RELAXED);
+            pool_wakeup(pool);
+            return ctx_fill(&pool->ctx, buf, 1, len, len, 0);
+        } else {
+            pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(buf, pool->ids + slot * len, len);
+    memset(pool->ids + slot * len, 0, len);
+    __atomic_store_n(&pool->seq[slot], pos + pool->mask + 1,
+                     __ATOMIC_RELEASE);
+
+    if (pos + pool->lowat + 1 >=
+        __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED))
+        pool_wakeup(pool);
+
+    return buf;
+}
+
+
+void
+nanoid_pool_get_stats(const struct nanoid_pool *pool,
+                      struct nanoid_pool_stats *st)
+{
+    st->available = pool_count(pool);
+    st->refills = __atomic_load_n(&pool->refills, __ATOMIC_RELAXED);
+    st->refilled = __atomic_load_n(&pool->refilled, __ATOMIC_RELAXED);
+    st->underflows = __atomic_load_n(&pool->underflows, __ATOMIC_RELAXED);
 }
@@ -32,10 +32,60 @@
 /* ID default size/length (without the terminating NUL) */
 #define NANOID_SIZE     21
 
+/* Packed size of a default ID (21 6-bit symbols) */
+#define NANOID_PACKED_SIZE  16
+
+/* Default alphabet: A-Za-z0-9-_ (i.e., base64url; see RFC 4648) */
+#define NANOID_ALPHABET \
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+
+/* Default alphabet of sortable IDs: base64url in ascending ASCII order */
+#define NANOID_SORTABLE_ALPHABET \
+        "-0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz"
+
+/* Random engines */
+#define NANOID_ENGINE_SYSTEM    0 /* system random source (default) */
+#define NANOID_ENGINE_CHACHA    1 /* per-thread ChaCha20 buffer */
+
+/* Samplers mapping random data to symbols */
+#define NANOID_SAMPLER_MASK     0 /* mask and reject every byte (default) */
+#define NANOID_SAMPLER_DIGITS   1 /* base-N digits of 64-bit words */
+#define NANOID_SAMPLER_BITS     2 /* exact bit fields (power-of-2 size) */
+
+/* Flags for nanoid_generate_batch() */
+#define NANOID_BATCH_NUL        0x1 /* NUL-terminate every ID */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Precompiled alphabet context */
+struct nanoid_ctx;
+
+/*
+ * Random source callback: fills <buf> of size <n> with random data.
+ * Returns 0 on success, or -1 on error.
+ */
+typedef int (*nanoid_random_fn)(void *ctx, void *buf, size_t n);
+
+/* Pool of pre-generated IDs */
+struct nanoid_pool;
+
+/* Pool statistics */
+struct nanoid_pool_stats {
+    size_t available; /* IDs ready in the ring */
+    unsigned long long refills; /* wake-ups of the refill thread */
+    unsigned long long refilled; /* IDs generated into the ring */
+    unsigned long long underflows; /* takes served synchronously */
+};
+
+/* Random data statistics of a thread */
+struct nanoid_stats {
+    unsigned long long random_bytes; /* bytes drawn from the engine */
+    unsigned long long random_calls; /* refills from the engine */
+    unsigned long long source_calls; /* calls to the system source */
+};
+
 /*
  * Generates an ID of length <buflen> and stores into <buf>, using alphabet
  * <alphabet> of size <alphacnt>.
@@ -49,6 +99,25 @@ extern "C" {
 void *nanoid_generate_r(void *buf, size_t buflen,
                         const unsigned char *alphabet, size_t alphacnt);
 
+/*
+ * Generates <count> IDs of length <len> into <buf>, using alphabet
+ * <alphabet> of size <alphacnt> (the default alphabet if NULL).
+ * The n-th ID is stored at offset (n * <stride>) of <buf>; if <stride> is
+ * 0, the IDs are packed back to back.  If <flags> has NANOID_BATCH_NUL,
+ * every ID is followed by a terminating NUL.
+ *
+ * The random data is drawn in large chunks and fully consumed across the
+ * ID boundaries, so it's much faster than calling nanoid_generate_r()
+ * <count> times.
+ *
+ * Returns a pointer to <buf> on success, or NULL on error.
+ *
+ * Reentrantable (i.e., thread-safe).
+ */
+void *nanoid_generate_batch(void *buf, size_t count, size_t len,
+                            size_t stride, int flags,
+                            const unsigned char *alphabet, size_t alphacnt);
+
 /*
  * Generates an ID of the default length, using alphabet <alphabet> of size
  * <alphacnt>.
@@ -62,6 +131,285 @@ void *nanoid_generate_r(void *buf, size_t buflen,
  */
 const char *nanoid_generate(const unsigned char *alphabet, size_t alphacnt);
 
+/*
+ * Checks that the string <str> of length <len> consists only of symbols of
+ * the alphabet <alphabet> of size <alphacnt> (the default alphabet if
+ * NULL; checked with SIMD where available).  The expected ID length is left
+ * to the caller to compare with <len>.
+ *
+ * Returns 1 if valid, 0 if not, or -1 on error (EINVAL for an alphabet
+ * size not in the range [2, 255]).
+ *
+ * Reentrantable (i.e., thread-safe).
+ */
+int nanoid_validate(const void *str, size_t len,
+                    const unsigned char *alphabet, size_t alphacnt);
+
+/*
+ * Validates <count> strings of length <len> in <buf>, the n-th one at
+ * offset <n * stride> (back to back if <stride> is 0), as
+ * nanoid_validate() does.  If <valid> is not NULL, the result of the n-th
+ * string (1 or 0) is stored into <valid[n]>.
+ *
+ * Returns 1 if all are valid, 0 if not, or -1 on error.
+ */
+int nanoid_validate_batch(const void *buf, size_t count, size_t len,
+                          size_t stride, const unsigned char *alphabet,
+                          size_t alphacnt, unsigned char *valid);
+
+/*
+ * Returns the size of a packed ID of length <len> with the alphabet
+ * <alphabet> of size <alphacnt> (the default alphabet if NULL), i.e.,
+ * log2(alphacnt) bits per symbol rounded up to whole bytes.
+ *
+ * Returns 0 on error (EINVAL if <alphacnt> isn't a power of 2 in the range
+ * [2, 128]).
+ */
+size_t nanoid_packed_size(size_t len, const unsigned char *alphabet,
+                          size_t alphacnt);
+
+/*
+ * Packs the ID <id> of length <len> into <dst> of nanoid_packed_size()
+ * bytes: the bit string of the symbol indexes, the first symbol in the
+ * high bits, padded with zero bits.  Packed IDs compare (memcmp) as their
+ * symbol indexes, so they keep the order of an ascending alphabet.
+ * Converted with SIMD for 64-symbol ASCII alphabets.
+ *
+ * Returns a pointer to <dst> on success, or NULL on error (EINVAL if the
+ * alphabet isn't supported, or <id> has a non-symbol).
+ *
+ * Reentrantable (i.e., thread-safe).
+ */
+void *nanoid_pack(void *dst, const void *id, size_t len,
+                  const unsigned char *alphabet, size_t alphacnt);
+
+/*
+ * Unpacks the packed ID <src> into the ID of length <len> stored into
+ * <buf> (NOT NUL-terminated).
+ *
+ * Returns a pointer to <buf> on success, or NULL on error (EINVAL if the
+ * alphabet isn't supported, or the pad bits aren't zero).
+ */
+void *nanoid_unpack(void *buf, size_t len, const void *src,
+                    const unsigned char *alphabet, size_t alphacnt);
+
+/*
+ * Packs <count> IDs of length <len> in <ids>, the n-th one at offset
+ * <n * stride> (back to back if <stride> is 0), into <dst> back to back.
+ *
+ * Returns a pointer to <dst> on success, or NULL on error.
+ */
+void *nanoid_pack_batch(void *dst, const void *ids, size_t count,
+                        size_t len, size_t stride,
+                        const unsigned char *alphabet, size_t alphacnt);
+
+/*
+ * Unpacks <count> packed IDs back to back in <src> into IDs of length
+ * <len> stored into <buf>, laid out as by nanoid_generate_batch() with
+ * <stride> and <flags>.
+ *
+ * Returns a pointer to <buf> on success, or NULL on error.
+ */
+void *nanoid_unpack_batch(void *buf, size_t count, size_t len,
+                          size_t stride, int flags, const void *src,
+                          const unsigned char *alphabet, size_t alphacnt);
+
+/*
+ * Generates a sortable ID of length <buflen> and stores into <buf>: the
+ * leading characters encode the time in milliseconds and a counter within
+ * the same millisecond, and the rest are random.  The IDs generated by a
+ * process sort (bytewise) in generation order, which keeps database index
+ * inserts local.
+ * <alphabet> must be in strictly ascending byte order; if it is NULL, the
+ * base64url symbols in ASCII order are used (10 leading characters).
+ *
+ * Returns a pointer to <buf> on success, or NULL on error (EINVAL if
+ * <alphabet> is not ascending, or <buflen> leaves no random characters).
+ *
+ * Reentrantable (i.e., thread-safe).
+ */
+void *nanoid_generate_sortable(void *buf, size_t buflen,
+                               const unsigned char *alphabet,
+                               size_t alphacnt);
+
+/*
+ * Creates a context for generating IDs of length <len> with alphabet
+ * <alphabet> of size <alphacnt> (the default alphabet if NULL).
+ * The alphabet is copied and checked once, and its mask, symbol lookup
+ * table and random data budget are precomputed, so the per-ID generation
+ * is a plain table walk.
+ *
+ * Returns the new context on success, or NULL on error.
+ */
+struct nanoid_ctx *nanoid_ctx_new(const unsigned char *alphabet,
+                                  size_t alphacnt, size_t len);
+
+/*
+ * Frees the context <ctx>.
+ */
+void nanoid_ctx_free(struct nanoid_ctx *ctx);
+
+/*
+ * Selects the sampler <sampler> of the context <ctx>:
+ * - NANOID_SAMPLER_MASK: masks every random byte and rejects the ones
+ *   outside the alphabet (default);
+ * - NANOID_SAMPLER_DIGITS: extracts several base-N digits from every
+ *   random 64-bit word, rejecting only the words that would bias them;
+ *   for alphabets whose size isn't a power of 2, this takes much less
+ *   random data (e.g., 0.73 instead of 1.78 bytes/symbol for 36 symbols);
+ * - NANOID_SAMPLER_BITS: slices the random data into exact
+ *   log2(alphacnt)-bit fields; only for alphabets whose size is a power
+ *   of 2, e.g., a default ID takes exactly 16 bytes.
+ * All of them are uniform.
+ *
+ * Must be called before the context is used by other threads.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int nanoid_ctx_set_sampler(struct nanoid_ctx *ctx, int sampler);
+
+/*
+ * Generates an ID with the context <ctx> and stores into <buf>, which must
+ * have room for the context's ID length.
+ *
+ * Returns a pointer to <buf> on success, or NULL on error.
+ *
+ * Reentrantable (i.e., thread-safe); a context can be shared by threads.
+ */
+void *nanoid_ctx_generate(const struct nanoid_ctx *ctx, void *buf);
+
+/*
+ * Same as nanoid_generate_batch(), but with the context <ctx>.
+ */
+void *nanoid_ctx_generate_batch(const struct nanoid_ctx *ctx, void *buf,
+                                size_t count, size_t stride, int flags);
+
+/*
+ * Creates a pool of IDs pre-generated with a copy of the context <ctx>:
+ * a lock-free ring of <capacity> IDs (rounded up to a power of 2), filled
+ * at creation and refilled by a background thread whenever the number of
+ * ready IDs drops to <lowat> (capacity/2 if 0).
+ *
+ * Returns the new pool on success, or NULL on error.
+ */
+struct nanoid_pool *nanoid_pool_new(const struct nanoid_ctx *ctx,
+                                    size_t capacity, size_t lowat);
+
+/*
+ * Stops the refill thread and destroys the pool <pool>.
+ */
+void nanoid_pool_free(struct nanoid_pool *pool);
+
+/*
+ * Takes an ID from the pool <pool> and stores into <buf>, which must have
+ * room for the context's ID length.  If the ring is empty, the ID is
+ * generated synchronously.  In a forked child, every ID is generated
+ * synchronously, since the ring holds the same IDs as in the parent.
+ *
+ * Returns a pointer to <buf> on success, or NULL on error.
+ *
+ * Thread-safe and lock-free.
+ */
+void *nanoid_pool_take(struct nanoid_pool *pool, void *buf);
+
+/*
+ * Gets the statistics of the pool <pool> into <st>.
+ */
+void nanoid_pool_get_stats(const struct nanoid_pool *pool,
+                           struct nanoid_pool_stats *st);
+
+/*
+ * Selects the random engine <engine> for all ID generations:
+ * - NANOID_ENGINE_SYSTEM: read the system random source (e.g.,
+ *   getentropy()) on every refill;
+ * - NANOID_ENGINE_CHACHA: serve refills from a per-thread ChaCha20
+ *   keystream buffer, which is seeded and periodically reseeded from the
+ *   system random source, and is safe across fork().
+ *
+ * Should be called before generating any IDs; NOT thread-safe.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int nanoid_set_engine(int engine);
+
+/*
+ * Returns the current random engine.
+ */
+int nanoid_get_engine(void);
+
+/*
+ * Sets the random source to the callback <fn>, which is called with the
+ * opaque <ctx> and at most 64 KiB at once, and possibly from several
+ * threads concurrently.  The built-in source is restored if <fn> is NULL.
+ * The random engine is layered on top of the source.
+ *
+ * Should be called before generating any IDs; NOT thread-safe.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int nanoid_set_random_source(nanoid_random_fn fn, void *ctx);
+
+/*
+ * Selects the built-in random source <name>:
+ * - "auto" (or NULL): the best system source (the default);
+ * - "vdso": Linux vDSO getrandom();
+ * - "getentropy", "getrandom", "arc4random": the libc functions;
+ * - "urandom": reads of [/dev/urandom];
+ * - "seeded": a fast deterministic PRNG (see nanoid_seed_random_source()).
+ *
+ * Should be called before generating any IDs; NOT thread-safe.
+ *
+ * Returns 0 on success, or -1 on error (EINVAL for an unknown source,
+ * ENOTSUP for a source not available on this system).
+ */
+int nanoid_select_random_source(const char *name);
+
+/*
+ * Selects the "seeded" random source with the seed <seed>: every thread
+ * draws from its own xoshiro256** stream, numbered in the order of their
+ * first draw, so single-threaded runs are reproducible.  NOT secure;
+ * only for benchmarks and tests.
+ *
+ * Should be called before generating any IDs; NOT thread-safe.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int nanoid_seed_random_source(unsigned long long seed);
+
+/*
+ * Returns the name of the current random source: "custom", "seeded", or
+ * the system source ("vdso", "getentropy", "getrandom", "arc4random" or
+ * "urandom"; "auto" resolves to the one in use).
+ */
+const char *nanoid_get_random_source(void);
+
+/*
+ * Gets the random data statistics of the calling thread into <st>.
+ */
+void nanoid_get_stats(struct nanoid_stats *st);
+
+/*
+ * Resets the random data statistics of the calling thread.
+ */
+void nanoid_reset_stats(void);
+
+/*
+ * Forces the symbol mapping kernel <name>: "scalar", or on x86 "ssse3",
+ * "avx2" and "avx512" (VBMI2).  The best kernel supported by the CPU is
+ * selected at load time, and is restored if <name> is NULL or "auto".
+ *
+ * Should be called before generating any IDs; NOT thread-safe.
+ *
+ * Returns 0 on success, or -1 on error (EINVAL for an unknown kernel,
+ * ENOTSUP for a kernel not supported by the CPU).
+ */
+int nanoid_set_kernel(const char *name);
+
+/*
+ * Returns the name of the current symbol mapping kernel.
+ */
+const char *nanoid_get_kernel(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,257 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Nano ID for C++17: a header-only generator specialized at compile time
+ * for its alphabet and length.
+ *
+ *     inline constexpr char hex[] = "0123456789abcdef";
+ *     nanoid::generator<hex, 32> gen;
+ *     std::array<char, 32> id = gen();
+ *
+ * The alphabet is checked, and its mask and symbol lookup table are built,
+ * at compile time; the random data comes from the same system sources as
+ * the C library (nanoid_rand.h).
+ */
+
+#ifndef NANOID_HPP_
+#define NANOID_HPP_
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+#include "nanoid_rand.h"
+
+namespace nanoid {
+
+/* Alphabet: A-Za-z0-9-_ (i.e., base64url; see RFC 4648, Section 5) */
+inline constexpr char default_alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* ID default size/length */
+inline constexpr std::size_t default_size = 21;
+
+namespace detail {
+
+inline constexpr std::uint16_t symbol_reject = 0x100;
+
+constexpr std::size_t
+length(const char *s)
+{
+    std::size_t n = 0;
+
+    while (s[n] != '\0')
+        ++n;
+    return n;
+}
+
+/* Smallest (2^k - 1) covering <n> - 1 */
+constexpr unsigned
+mask(std::size_t n)
+{
+    unsigned m = 1;
+
+    while (m < n - 1)
+        m = (m << 1) | 1;
+    return m;
+}
+
+constexpr unsigned
+bits(unsigned mask)
+{
+    unsigned b = 0;
+
+    while (mask != 0) {
+        ++b;
+        mask >>= 1;
+    }
+    return b;
+}
+
+/* Integer square root, rounded up */
+constexpr std::size_t
+isqrt_up(std::size_t v)
+{
+    std::size_t x = 0;
+
+    while (x * x < v)
+        ++x;
+    return x;
+}
+
+/* Random byte -> symbol, or symbol_reject if masked outside the alphabet */
+constexpr std::array<std::uint16_t, 256>
+table(const char *alphabet, std::size_t n, unsigned mask)
+{
+    std::array<std::uint16_t, 256> t{};
+
+    for (unsigned b = 0; b < 256; ++b) {
+        unsigned i = b & mask;
+        t[b] = (i < n) ? static_cast<unsigned char>(alphabet[i])
+                       : symbol_reject;
+    }
+    return t;
+}
+
+} /* namespace detail */
+
+
+template <const char *Alphabet = default_alphabet,
+          std::size_t Len = default_size>
+class generator {
+public:
+    static constexpr std::size_t alphabet_size = detail::length(Alphabet);
+    static constexpr std::size_t size = Len;
+
+    static_assert(alphabet_size >= 2 && alphabet_size <= 255,
+                  "nanoid: alphabet size must be in the range [2, 255]");
+    static_assert(Len > 0, "nanoid: ID length must be positive");
+
+    /*
+     * Generates an ID into <buf>, which must have room for <Len>
+     * characters (no terminating NUL is stored).
+     *
+     * Returns <buf> on success, or nullptr on error (with errno set).
+     */
+    char *
+    generate(char *buf) const noexcept
+    {
+        if constexpr (pow2)
+            return generate_bits(buf);
+        else
+            return generate_mask(buf);
+    }
+
+    /*
+     * Generates an ID; throws std::system_error on error.
+     */
+    std::array<char, Len>
+    operator()() const
+    {
+        std::array<char, Len> id;
+
+        if (generate(id.data()) == nullptr)
+            throw std::system_error(errno, std::generic_category(),
+                                    "nanoid: failed to get random data");
+        return id;
+    }
+
+private:
+    static constexpr unsigned mask = detail::mask(alphabet_size);
+    static constexpr unsigned bits = detail::bits(mask);
+    static constexpr bool pow2 = (mask + 1 == alphabet_size);
+
+    /*
+     * Random bytes per refill of the mask sampler, as for a C context:
+     * the expected amount plus 2 standard deviations of the number of
+     * draws, rounded up to 8 and up to the maximum allowed by the random
+     * source.
+     */
+    static constexpr std::size_t range = mask + 1;
+    static constexpr std::size_t step_mean =
+            (Len * range + alphabet_size - 1) / alphabet_size;
+    static constexpr std::size_t step_var =
+            (Len * range * (range - alphabet_size) +
+             alphabet_size * alphabet_size - 1) /
+            (alphabet_size * alphabet_size);
+    static constexpr std::size_t step_want =
+            (step_mean + 2 * detail::isqrt_up(step_var) + 7) & ~std::size_t(7);
+    static constexpr std::size_t step =
+            (step_want < RANDOMBYTES_MAX) ? step_want : RANDOMBYTES_MAX;
+
+    /* Random bytes of the bits sampler: whole 32-bit words */
+    static constexpr std::size_t bits_bytes = (Len * bits + 31) / 32 * 4;
+    static constexpr std::size_t bits_chunk =
+            (bits_bytes < RANDOMBYTES_MAX) ? bits_bytes : RANDOMBYTES_MAX;
+
+    static constexpr std::array<std::uint16_t, 256> table =
+            detail::table(Alphabet, alphabet_size, mask);
+
+    /*
+     * Masks every random byte and rejects the ones outside the alphabet;
+     * the symbol is stored unconditionally, and only kept if accepted.
+     */
+    static char *
+    generate_mask(char *buf) noexcept
+    {
+        unsigned char rnd[step];
+        std::size_t i = 0, j;
+        std::uint16_t s;
+
+        for (;;) {
+            if (generate_randombytes(rnd, sizeof(rnd)) != 0)
+                return nullptr;
+            for (j = 0; j < step; ++j) {
+                s = table[rnd[j]];
+                buf[i] = static_cast<char>(s);
+                i += !(s & detail::symbol_reject);
+                if (i == Len)
+                    return buf;
+            }
+        }
+    }
+
+    /*
+     * Slices the random data into exact <bits>-bit fields, for alphabets
+     * whose size is a power of 2 (no rejection).
+     */
+    static char *
+    generate_bits(char *buf) noexcept
+    {
+        unsigned char rnd[bits_chunk];
+        std::size_t remain = bits_bytes, pos = 0, have = 0, i;
+        std::uint64_t acc = 0;
+        std::uint32_t w;
+        unsigned n = 0;
+
+        for (i = 0; i < Len; ++i) {
+            if (n < bits) {
+                if (pos == have) {
+                    have = (remain < bits_chunk) ? remain : bits_chunk;
+                    if (generate_randombytes(rnd, have) != 0)
+                        return nullptr;
+                    remain -= have;
+                    pos = 0;
+                }
+                std::memcpy(&w, rnd + pos, sizeof(w));
+                pos += sizeof(w);
+                acc |= static_cast<std::uint64_t>(w) << n;
+                n += 32;
+            }
+            buf[i] = Alphabet[acc & mask];
+            acc >>= bits;
+            n -= bits;
+        }
+
+        return buf;
+    }
+};
+
+} /* namespace nanoid */
+
+#endif
@@ -34,6 +34,33 @@ Both <length> and <alphabet> are optional; specify them to use custom
 length and/or alphabet.
 
 Returns the generated ID, or nil if error occurred.
+
+ids = nanoid.generate_many(n, length?, alphabet?)
+
+Generates <n> IDs in a single pass (see nanoid_generate_batch()), with
+the same optional <length> and <alphabet> as nanoid.generate().
+
+Returns a sequence of the <n> generated IDs, or nil if error occurred.
+
+gen = nanoid.new(length?, alphabet?)
+
+Creates a generator of IDs of <length> with <alphabet> (both optional,
+as nanoid.generate()), which keeps the preprocessed alphabet (see
+nanoid_ctx_new()) and a ring of pre-generated IDs.
+
+Returns the generator, or nil if error occurred.
+
+id = gen()
+id = gen:generate()
+
+Returns the next ID of the generator <gen>, or nil if error occurred.
+
+ok = nanoid.validate(id, length?, alphabet?)
+
+Checks that <id> is a string of <length> (default: 21) symbols of
+<alphabet> (default: the default alphabet).
+
+Returns true or false, or nil if error occurred (e.g., invalid alphabet).
 --]]
 
 local ffi = require("ffi")
@@ -74,10 +101,36 @@ ffi.cdef[[
 // #define NANOID_SIZE     21
 static const int NANOID_SIZE = 21;
 
-void *nanoid_generate_r(void *buf, size_t buflen,
-                        const unsigned char *alphabet, size_t alphacnt);
+struct nanoid_ctx;
+
+void *nanoid_generate_batch(void *buf, size_t count, size_t len,
+                            size_t stride, int flags,
+                            const unsigned char *alphabet, size_t alphacnt);
+int nanoid_validate(const void *str, size_t len,
+                    const unsigned char *alphabet, size_t alphacnt);
+struct nanoid_ctx *nanoid_ctx_new(const unsigned char *alphabet,
+                                  size_t alphacnt, size_t len);
+void nanoid_ctx_free(struct nanoid_ctx *ctx);
+void *nanoid_ctx_generate_batch(const struct nanoid_ctx *ctx, void *buf,
+                                size_t count, size_t stride, int flags);
+// internal to libnanoid, see nanoid.c
+const volatile unsigned int *nanoid_fork_generation(void);
 ]]
 
+local ffi_string = ffi.string
+
+-- table.new() of LuaJIT 2.1, to presize the result of generate_many()
+local ok, new_tab = pcall(require, "table.new")
+if not ok then
+    new_tab = function() return {} end
+end
+local forkgen = nanoid.nanoid_fork_generation()
+
+
+-- Scratch buffer for generate_many(), grown up to BUFFER_MAX and kept
+-- across calls; larger requests get their own, freed by the GC, so that
+-- one huge call doesn't pin its buffer for the lifetime of the module.
+local BUFFER_MAX = 65536
 
 local get_buffer
 do
@@ -86,6 +139,9 @@ do
     local _buf
 
     function get_buffer(size)
+        if size > BUFFER_MAX then
+            return ffi.new(_buf_type, size)
+        end
         if size > _buf_size then
             _buf_size = size
             _buf = ffi.new(_buf_type, _buf_size)
@@ -95,21 +151,137 @@ do
 end
 
 
+-- Generator: an ID context and a ring of IDs generated in one C call,
+-- sliced with ffi.string() one by one, so that the per-ID work stays in
+-- the JIT-compiled code.  The ring is refilled when it's empty, or in a
+-- forked child, which must not repeat the IDs of its parent.
+local RING_SIZE = 8192 -- bytes of IDs generated per refill
+
+local Generator = {}
+Generator.__index = Generator
+
+local function new(length, alphabet)
+    length = length or nanoid.NANOID_SIZE
+    local alphacnt = alphabet and #alphabet or 0
+
+    local ctx = nanoid.nanoid_ctx_new(alphabet, alphacnt, length)
+    if ctx == nil then
+        return nil
+    end
+    ffi.gc(ctx, nanoid.nanoid_ctx_free)
+
+    local count = 1
+    if length > 0 and length < RING_SIZE then
+        count = math.floor(RING_SIZE / length)
+    end
+
+    return setmetatable({
+        ctx = ctx,
+        length = length,
+        count = count,
+        ring = ffi.new("char[?]", count * length),
+        next = count, -- empty
+        forkgen = forkgen[0],
+    }, Generator)
+end
+
+function Generator:generate()
+    local i = self.next
+    if i == self.count or self.forkgen ~= forkgen[0] then
+        self.forkgen = forkgen[0]
+        local ret = nanoid.nanoid_ctx_generate_batch(self.ctx, self.ring,
+                                                     self.count, 0, 0)
+        if ret == nil then
+            self.next = self.count
+            return nil
+        end
+        i = 0
+    end
+    self.next = i + 1
+    return ffi_string(self.ring + i * self.length, self.length)
+end
+
+Generator.__call = Generator.generate
+
+
+-- Generators of nanoid.generate(), by alphabet and length
+local generators = {}
+local generators_count = 0
+local GENERATORS_MAX = 64
+local default_generator = new()
+
+
 local function generate(length, alphabet)
+    if length == nil and alphabet == nil then
+        return default_generator:generate()
+    end
+
+    length = length or nanoid.NANOID_SIZE
+    local byalpha = generators[alphabet or ""]
+    local gen = byalpha and byalpha[length]
+    if gen == nil then
+        gen = new(length, alphabet)
+        if gen == nil then
+            return nil
+        end
+        -- Bound the cache, for callers passing ever-changing alphabets
+        if generators_count >= GENERATORS_MAX then
+            generators = {}
+            generators_count = 0
+        end
+        byalpha = generators[alphabet or ""]
+        if byalpha == nil then
+            byalpha = {}
+            generators[alphabet or ""] = byalpha
+        end
+        byalpha[length] = gen
+        generators_count = generators_count + 1
+    end
+    return gen:generate()
+end
+
+
+local function generate_many(n, length, alphabet)
     length = length or nanoid.NANOID_SIZE
     local alphacnt = alphabet and #alphabet or 0
 
-    local buf = get_buffer(length)
-    local id = nanoid.nanoid_generate_r(buf, length, alphabet, alphacnt)
-    if id == nil then
+    if n <= 0 then
+        return {}
+    end
+    local ids = new_tab(n, 0)
+
+    local buf = get_buffer(n * length)
+    local ret = nanoid.nanoid_generate_batch(buf, n, length, 0, 0,
+                                             alphabet, alphacnt)
+    if ret == nil then
+        return nil
+    end
+    for i = 1, n do
+        ids[i] = ffi_string(buf + (i - 1) * length, length)
+    end
+    return ids
+end
+
+
+local function validate(id, length, alphabet)
+    length = length or nanoid.NANOID_SIZE
+    if type(id) ~= "string" or #id ~= length then
+        return false
+    end
+
+    local alphacnt = alphabet and #alphabet or 0
+    local ret = nanoid.nanoid_validate(id, length, alphabet, alphacnt)
+    if ret == -1 then
         return nil
-    else
-        return ffi.string(buf, length)
     end
+    return ret == 1
 end
 
 
 return {
     SIZE = nanoid.NANOID_SIZE,
     generate = generate,
+    generate_many = generate_many,
+    new = new,
+    validate = validate,
 }
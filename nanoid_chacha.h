@@ -0,0 +1,233 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * ChaCha20 stream cipher, used as the keystream generator of the buffered
+ * random engine.
+ *
+ * Based on the public domain "chacha-merged.c" by D. J. Bernstein, as used
+ * by the arc4random(3) implementations of OpenBSD and DragonFly BSD.
+ * https://cr.yp.to/chacha.html
+ */
+
+#ifndef NANOID_CHACHA_H_
+#define NANOID_CHACHA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CHACHA_KEYSZ    32
+#define CHACHA_IVSZ     8
+#define CHACHA_BLOCKSZ  64
+
+struct chacha_ctx {
+    uint32_t input[16];
+};
+
+#define CHACHA_ROTL32(v, n) \
+        ((uint32_t)((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA_QUARTERROUND(a, b, c, d) do {                    \
+        a += b; d ^= a; d = CHACHA_ROTL32(d, 16);               \
+        c += d; b ^= c; b = CHACHA_ROTL32(b, 12);               \
+        a += b; d ^= a; d = CHACHA_ROTL32(d, 8);                \
+        c += d; b ^= c; b = CHACHA_ROTL32(b, 7);                \
+} while (0)
+
+
+static inline uint32_t
+chacha_load32(const unsigned char *p)
+{
+    return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void
+chacha_store32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v);
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+
+/*
+ * Set up the 256-bit key <key> and the 64-bit nonce <iv>, and reset the
+ * block counter.
+ */
+static inline void
+chacha_keysetup(struct chacha_ctx *x, const unsigned char *key,
+                const unsigned char *iv)
+{
+    int i;
+
+    /* "expand 32-byte k" */
+    x->input[0] = 0x61707865U;
+    x->input[1] = 0x3320646eU;
+    x->input[2] = 0x79622d32U;
+    x->input[3] = 0x6b206574U;
+    for (i = 0; i < 8; ++i)
+        x->input[4 + i] = chacha_load32(key + 4 * i);
+    x->input[12] = 0;
+    x->input[13] = 0;
+    x->input[14] = chacha_load32(iv);
+    x->input[15] = chacha_load32(iv + 4);
+}
+
+
+#if defined(__SSE2__)
+
+#define CHACHA_ROTL128(v, n) \
+        _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define CHACHA_QUARTERROUND128(a, b, c, d) do {                         \
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a);               \
+        d = CHACHA_ROTL128(d, 16);                                      \
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);               \
+        b = CHACHA_ROTL128(b, 12);                                      \
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a);               \
+        d = CHACHA_ROTL128(d, 8);                                       \
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);               \
+        b = CHACHA_ROTL128(b, 7);                                       \
+} while (0)
+
+/*
+ * Generate 4 blocks at once, with every vector holding the same state word
+ * of the 4 blocks.  Returns the number of bytes generated.
+ */
+static inline size_t
+chacha_keystream4(struct chacha_ctx *x, unsigned char *out, size_t n)
+{
+    __m128i s[16], in[16], a0, a1, a2, a3, t0, t1, t2, t3;
+    uint64_t ctr;
+    size_t done;
+    int i;
+
+    for (done = 0; n - done >= 4 * CHACHA_BLOCKSZ;
+         done += 4 * CHACHA_BLOCKSZ, out += 4 * CHACHA_BLOCKSZ) {
+        ctr = (uint64_t)x->input[12] | ((uint64_t)x->input[13] << 32);
+        for (i = 0; i < 16; ++i)
+            in[i] = _mm_set1_epi32((int)x->input[i]);
+        in[12] = _mm_set_epi32((int)(uint32_t)(ctr + 3),
+                               (int)(uint32_t)(ctr + 2),
+                               (int)(uint32_t)(ctr + 1),
+                               (int)(uint32_t)ctr);
+        in[13] = _mm_set_epi32((int)(uint32_t)((ctr + 3) >> 32),
+                               (int)(uint32_t)((ctr + 2) >> 32),
+                               (int)(uint32_t)((ctr + 1) >> 32),
+                               (int)(uint32_t)(ctr >> 32));
+        for (i = 0; i < 16; ++i)
+            s[i] = in[i];
+
+        for (i = 0; i < 10; ++i) {
+            CHACHA_QUARTERROUND128(s[0], s[4], s[8],  s[12]);
+            CHACHA_QUARTERROUND128(s[1], s[5], s[9],  s[13]);
+            CHACHA_QUARTERROUND128(s[2], s[6], s[10], s[14]);
+            CHACHA_QUARTERROUND128(s[3], s[7], s[11], s[15]);
+            CHACHA_QUARTERROUND128(s[0], s[5], s[10], s[15]);
+            CHACHA_QUARTERROUND128(s[1], s[6], s[11], s[12]);
+            CHACHA_QUARTERROUND128(s[2], s[7], s[8],  s[13]);
+            CHACHA_QUARTERROUND128(s[3], s[4], s[9],  s[14]);
+        }
+
+        /* Transpose back to 4 consecutive blocks (little-endian). */
+        for (i = 0; i < 16; i += 4) {
+            a0 = _mm_add_epi32(s[i], in[i]);
+            a1 = _mm_add_epi32(s[i + 1], in[i + 1]);
+            a2 = _mm_add_epi32(s[i + 2], in[i + 2]);
+            a3 = _mm_add_epi32(s[i + 3], in[i + 3]);
+            t0 = _mm_unpacklo_epi32(a0, a1);
+            t1 = _mm_unpacklo_epi32(a2, a3);
+            t2 = _mm_unpackhi_epi32(a0, a1);
+            t3 = _mm_unpackhi_epi32(a2, a3);
+            _mm_storeu_si128((__m128i *)(void *)(out + 4 * i),
+                             _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i *)(void *)(out + 64 + 4 * i),
+                             _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i *)(void *)(out + 128 + 4 * i),
+                             _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i *)(void *)(out + 192 + 4 * i),
+                             _mm_unpackhi_epi64(t2, t3));
+        }
+
+        ctr += 4;
+        x->input[12] = (uint32_t)ctr;
+        x->input[13] = (uint32_t)(ctr >> 32);
+    }
+
+    return done;
+}
+
+#endif /* __SSE2__ */
+
+
+/*
+ * Generate <n> bytes of keystream into <out>; <n> must be a multiple of
+ * the block size (CHACHA_BLOCKSZ).
+ */
+static inline void
+chacha_keystream(struct chacha_ctx *x, unsigned char *out, size_t n)
+{
+    uint32_t s[16];
+    int i;
+
+#if defined(__SSE2__)
+    {
+        size_t done = chacha_keystream4(x, out, n);
+        out += done;
+        n -= done;
+    }
+#endif
+
+    for (; n >= CHACHA_BLOCKSZ; n -= CHACHA_BLOCKSZ, out += CHACHA_BLOCKSZ) {
+        for (i = 0; i < 16; ++i)
+            s[i] = x->input[i];
+
+        for (i = 0; i < 10; ++i) {
+            CHACHA_QUARTERROUND(s[0], s[4], s[8],  s[12]);
+            CHACHA_QUARTERROUND(s[1], s[5], s[9],  s[13]);
+            CHACHA_QUARTERROUND(s[2], s[6], s[10], s[14]);
+            CHACHA_QUARTERROUND(s[3], s[7], s[11], s[15]);
+            CHACHA_QUARTERROUND(s[0], s[5], s[10], s[15]);
+            CHACHA_QUARTERROUND(s[1], s[6], s[11], s[12]);
+            CHACHA_QUARTERROUND(s[2], s[7], s[8],  s[13]);
+            CHACHA_QUARTERROUND(s[3], s[4], s[9],  s[14]);
+        }
+
+        for (i = 0; i < 16; ++i)
+            chacha_store32(out + 4 * i, s[i] + x->input[i]);
+
+        /* 64-bit block counter */
+        if (++x->input[12] == 0)
+            x->input[13]++;
+    }
+}
+
+
+#endif
@@ -0,0 +1,136 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * Benchmark of the C++ generator (nanoid.hpp) against the C library.
+ *
+ * Usage: nanoid_hpp_bench [count]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "nanoid.h"
+#include "nanoid.hpp"
+
+namespace {
+
+constexpr char alnum36[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+volatile char sink;
+
+template <typename F>
+void
+measure(const char *name, std::size_t count, std::size_t len, F &&gen)
+{
+    char buf[256];
+    std::size_t i;
+
+    for (i = 0; i < count / 10; ++i) /* burn in */
+        gen(buf);
+
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < count; ++i) {
+        gen(buf);
+        sink = buf[len - 1];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - start).count();
+    std::printf("%-40s %8.1f ns/id\n", name,
+                static_cast<double>(ns) / static_cast<double>(count));
+}
+
+struct nanoid_ctx *
+new_ctx(const char *alphabet, std::size_t len, int sampler)
+{
+    struct nanoid_ctx *ctx;
+
+    ctx = nanoid_ctx_new(reinterpret_cast<const unsigned char *>(alphabet),
+                         alphabet ? std::strlen(alphabet) : 0, len);
+    if (ctx == nullptr || nanoid_ctx_set_sampler(ctx, sampler) == -1) {
+        std::fprintf(stderr, "ERROR: failed to create context\n");
+        std::exit(1);
+    }
+    return ctx;
+}
+
+} /* namespace */
+
+
+int
+main(int argc, char *argv[])
+{
+    std::size_t count = 1000000;
+    struct nanoid_ctx *ctx;
+
+    if (argc > 1)
+        count = std::strtoul(argv[1], nullptr, 10);
+    if (count == 0) {
+        std::fprintf(stderr, "usage: %s [count]\n", argv[0]);
+        return 1;
+    }
+
+    std::printf("Source: %s\n", nanoid_get_random_source());
+
+    std::printf("\nDefault alphabet, length 21:\n");
+    measure("C nanoid_generate_r()", count, 21, [](char *buf) {
+        nanoid_generate_r(buf, 21, nullptr, 0);
+    });
+    ctx = new_ctx(nullptr, 21, NANOID_SAMPLER_MASK);
+    measure("C nanoid_ctx_generate() (mask)", count, 21, [ctx](char *buf) {
+        nanoid_ctx_generate(ctx, buf);
+    });
+    nanoid_ctx_free(ctx);
+    measure("C++ generator<default_alphabet, 21>", count, 21,
+            [gen = nanoid::generator<>()](char *buf) {
+        gen.generate(buf);
+    });
+
+    std::printf("\n36-symbol alphabet, length 21:\n");
+    measure("C nanoid_generate_r()", count, 21, [](char *buf) {
+        nanoid_generate_r(buf, 21,
+                          reinterpret_cast<const unsigned char *>(alnum36),
+                          sizeof(alnum36) - 1);
+    });
+    ctx = new_ctx(alnum36, 21, NANOID_SAMPLER_MASK);
+    measure("C nanoid_ctx_generate() (mask)", count, 21, [ctx](char *buf) {
+        nanoid_ctx_generate(ctx, buf);
+    });
+    nanoid_ctx_free(ctx);
+    ctx = new_ctx(alnum36, 21, NANOID_SAMPLER_DIGITS);
+    measure("C nanoid_ctx_generate() (digits)", count, 21, [ctx](char *buf) {
+        nanoid_ctx_generate(ctx, buf);
+    });
+    nanoid_ctx_free(ctx);
+    measure("C++ generator<alnum36, 21>", count, 21,
+            [gen = nanoid::generator<alnum36, 21>()](char *buf) {
+        gen.generate(buf);
+    });
+
+    return 0;
+}
@@ -32,8 +32,37 @@
  * length and/or alphabet.
  *
  * Returns the generated ID, or nil if error occurred.
+ *
+ * ids = nanoid.generate_many(n, length?, alphabet?)
+ *
+ * Generates <n> IDs in a single pass (see nanoid_generate_batch()), with
+ * the same optional <length> and <alphabet> as nanoid.generate().
+ *
+ * Returns a sequence of the <n> generated IDs, or nil if error occurred.
+ *
+ * gen = nanoid.new(length?, alphabet?)
+ *
+ * Creates a generator of IDs of <length> with <alphabet> (both optional,
+ * as nanoid.generate()), which keeps the preprocessed alphabet (see
+ * nanoid_ctx_new()) and a reserve of pre-generated IDs.
+ *
+ * Returns the generator, or nil if error occurred.
+ *
+ * id = gen()
+ * id = gen:generate()
+ *
+ * Returns the next ID of the generator <gen>, or nil if error occurred.
+ *
+ * ok = nanoid.validate(id, length?, alphabet?)
+ *
+ * Checks that <id> is a string of <length> (default: 21) symbols of
+ * <alphabet> (default: the default alphabet).
+ *
+ * Returns true or false, or nil if error occurred (e.g., invalid alphabet).
  */
 
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <lua.h>
@@ -41,6 +70,29 @@
 
 #include "nanoid.h"
 
+/* Internal to libnanoid, see nanoid.c */
+const volatile unsigned int *nanoid_fork_generation(void);
+
+#define GENERATOR_MT       "nanoid.generator"
+#define GENERATOR_RESERVE  4096 /* bytes of IDs generated per refill */
+
+/*
+ * Generator: an ID context and a reserve of IDs generated in batches,
+ * handed out one by one.  The reserve is dropped in a forked child (e.g.,
+ * the nginx workers of OpenResty), so that it never repeats the IDs of
+ * its parent.
+ */
+struct generator {
+    struct nanoid_ctx *ctx;
+    size_t length;
+    size_t batch; /* IDs per refill */
+    size_t next; /* index of the next unused ID */
+    unsigned int forkgen; /* see nanoid_fork_generation() */
+    char ids[]; /* <batch> IDs back to back */
+};
+
+static const volatile unsigned int *generator_forkgen;
+
 /* NOTE: luaL_newlib() is available in Lua >=5.2 or LuaJIT >=2.1 */
 #ifndef luaL_newlib
 #define luaL_newlib(L, l) \
@@ -73,13 +125,185 @@ l_generate(lua_State *L)
 }
 
 
+static int
+l_generate_many(lua_State *L)
+{
+    const unsigned char *alphabet;
+    char stackbuf[1024], *buf;
+    size_t count, length, alphacnt, i;
+    lua_Integer n;
+
+    n = luaL_checkinteger(L, 1);
+    length = (size_t)luaL_optinteger(L, 2, NANOID_SIZE);
+    alphabet = (const unsigned char *)luaL_optlstring(L, 3, NULL, &alphacnt);
+    luaL_argcheck(L, n >= 0 && n <= INT_MAX, 1, "invalid count");
+    count = (size_t)n;
+
+    if (count == 0) {
+        lua_newtable(L);
+        return 1;
+    }
+    if (length == 0 || length > SIZE_MAX / count) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /*
+     * One buffer for all the IDs: on the stack if they're few, else a
+     * userdata, which the GC frees even if a push below raises an error.
+     */
+    if (count * length <= sizeof(stackbuf))
+        buf = stackbuf;
+    else
+        buf = lua_newuserdata(L, count * length);
+
+    if (nanoid_generate_batch(buf, count, length, 0, 0, alphabet,
+                              alphacnt) == NULL) {
+        lua_pushnil(L);
+    } else {
+        lua_createtable(L, (int)count, 0);
+        for (i = 0; i < count; ++i) {
+            lua_pushlstring(L, buf + i * length, length);
+            lua_rawseti(L, -2, (int)i + 1);
+        }
+    }
+
+    return 1;
+}
+
+
+static int
+l_new(lua_State *L)
+{
+    const unsigned char *alphabet;
+    struct generator *gen;
+    size_t length, alphacnt, batch;
+
+    length = (size_t)luaL_optinteger(L, 1, NANOID_SIZE);
+    alphabet = (const unsigned char *)luaL_optlstring(L, 2, NULL, &alphacnt);
+
+    batch = (length > 0 && length < GENERATOR_RESERVE) ?
+            GENERATOR_RESERVE / length : 1;
+    if (length > (SIZE_MAX - sizeof(*gen)) / batch) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* Set the metatable first, so that __gc frees the context */
+    gen = lua_newuserdata(L, sizeof(*gen) + batch * length);
+    gen->ctx = NULL;
+    gen->length = length;
+    gen->batch = batch;
+    gen->next = batch; /* empty */
+    gen->forkgen = *generator_forkgen;
+    luaL_getmetatable(L, GENERATOR_MT);
+    lua_setmetatable(L, -2);
+
+    gen->ctx = nanoid_ctx_new(alphabet, alphacnt, length);
+    if (gen->ctx == NULL)
+        lua_pushnil(L);
+
+    return 1;
+}
+
+
+static int
+l_gen_generate(lua_State *L)
+{
+    struct generator *gen;
+
+    gen = luaL_checkudata(L, 1, GENERATOR_MT);
+    if (gen->ctx == NULL)
+        return luaL_error(L, "generator already freed");
+
+    if (gen->next == gen->batch || gen->forkgen != *generator_forkgen) {
+        gen->forkgen = *generator_forkgen;
+        if (nanoid_ctx_generate_batch(gen->ctx, gen->ids, gen->batch, 0,
+                                      0) == NULL) {
+            gen->next = gen->batch;
+            lua_pushnil(L);
+            return 1;
+        }
+        gen->next = 0;
+    }
+
+    lua_pushlstring(L, gen->ids + gen->next * gen->length, gen->length);
+    gen->next++;
+
+    return 1;
+}
+
+
+static int
+l_gen_gc(lua_State *L)
+{
+    struct generator *gen;
+
+    gen = luaL_checkudata(L, 1, GENERATOR_MT);
+    nanoid_ctx_free(gen->ctx);
+    gen->ctx = NULL;
+
+    return 0;
+}
+
+
+static int
+l_validate(lua_State *L)
+{
+    const unsigned char *alphabet;
+    const char *id;
+    size_t idlen, length, alphacnt;
+    int ret;
+
+    length = (size_t)luaL_optinteger(L, 2, NANOID_SIZE);
+    alphabet = (const unsigned char *)luaL_optlstring(L, 3, NULL, &alphacnt);
+
+    if (lua_type(L, 1) != LUA_TSTRING) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    id = lua_tolstring(L, 1, &idlen);
+    if (idlen != length) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+
+    ret = nanoid_validate(id, idlen, alphabet, alphacnt);
+    if (ret == -1)
+        lua_pushnil(L);
+    else
+        lua_pushboolean(L, ret);
+
+    return 1;
+}
+
+
 int
 luaopen_nanoid(lua_State *L)
 {
     static const struct luaL_Reg funcs[] = {
         { "generate", l_generate },
+        { "generate_many", l_generate_many },
+        { "new", l_new },
+        { "validate", l_validate },
         { NULL, NULL },
     };
+
+    generator_forkgen = nanoid_fork_generation();
+
+    /* Generator metatable; its __index is itself for gen:generate() */
+    if (luaL_newmetatable(L, GENERATOR_MT)) {
+        lua_pushcfunction(L, l_gen_generate);
+        lua_setfield(L, -2, "__call");
+        lua_pushcfunction(L, l_gen_generate);
+        lua_setfield(L, -2, "generate");
+        lua_pushcfunction(L, l_gen_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
     luaL_newlib(L, funcs);
 
     /* Constants */
@@ -28,58 +28,2161 @@
  * https://github.com/ai/nanoid
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#define HAVE_AFFINITY
+#endif
+
+#include <errno.h>
+#include <fcntl.h> /* open() */
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h> /* clock_gettime() */
 #include <unistd.h> /* getopt() */
+#include <sys/mman.h>
+
+#include "nanoid.h"
+#include "nanoid_test.c"
+
+/*
+ * Cycle counter for the latency samples, converted to ns by calibration
+ * against CLOCK_MONOTONIC over the whole run.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TIMER_NAME      "rdtsc"
+static inline uint64_t
+timer_read(void)
+{
+    return __rdtsc();
+}
+#elif defined(__aarch64__)
+#define TIMER_NAME      "cntvct"
+static inline uint64_t
+timer_read(void)
+{
+    uint64_t v;
+
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) : : "memory");
+    return v;
+}
+#else
+#define TIMER_NAME      "clock_gettime"
+static inline uint64_t
+timer_read(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+
+static char *progname;
+static size_t speed_count = 1000000; /* iterations for speed test */
+
+static void usage(void);
+
+
+static void
+set_engine(const char *name)
+{
+    int engine;
+
+    if (strcmp(name, "system") == 0) {
+        engine = NANOID_ENGINE_SYSTEM;
+    } else if (strcmp(name, "chacha") == 0) {
+        engine = NANOID_ENGINE_CHACHA;
+    } else {
+        fprintf(stderr, "ERROR: invalid engine: %s\n", name);
+        exit(1);
+    }
+
+    if (nanoid_set_engine(engine) == -1) {
+        fprintf(stderr, "ERROR: failed to set engine: %s\n", name);
+        exit(1);
+    }
+}
+
+
+static size_t
+timespec_diff(struct timespec *tend, struct timespec *tstart)
+{
+    long int t;
+
+    t = (tend->tv_sec - tstart->tv_sec) * 1000000000L;
+    t += tend->tv_nsec;
+    t -= tstart->tv_nsec;
+
+    return (size_t)t;
+}
+
+
+static void
+set_kernel(const char *name)
+{
+    if (nanoid_set_kernel(name) == -1) {
+        fprintf(stderr, "ERROR: invalid or unsupported kernel: %s\n", name);
+        exit(1);
+    }
+}
+
+
+/*
+ * Select the random source <name>, or the seeded source with "seeded:N".
+ */
+static void
+set_source(const char *name)
+{
+    char *end;
+    unsigned long long seed;
+    int ret;
+
+    if (strncmp(name, "seeded:", 7) == 0) {
+        errno = 0;
+        seed = strtoull(name + 7, &end, 0);
+        if (errno != 0 || *end != '\0' || end == name + 7) {
+            fprintf(stderr, "ERROR: invalid seed: %s\n", name + 7);
+            exit(1);
+        }
+        ret = nanoid_seed_random_source(seed);
+    } else {
+        ret = nanoid_select_random_source(name);
+    }
+    if (ret == -1) {
+        fprintf(stderr, "ERROR: invalid or unsupported source: %s\n", name);
+        exit(1);
+    }
+}
+
+
+static int
+parse_sampler(const char *name)
+{
+    if (strcmp(name, "mask") == 0) {
+        return NANOID_SAMPLER_MASK;
+    } else if (strcmp(name, "digits") == 0) {
+        return NANOID_SAMPLER_DIGITS;
+    } else if (strcmp(name, "bits") == 0) {
+        return NANOID_SAMPLER_BITS;
+    } else {
+        fprintf(stderr, "ERROR: invalid sampler: %s\n", name);
+        exit(1);
+    }
+}
+
+
+/*
+ * Create a context for the given alphabet, length and sampler.
+ */
+static struct nanoid_ctx *
+new_ctx(const unsigned char *alphabet, size_t alphacnt, size_t length,
+        int sampler)
+{
+    struct nanoid_ctx *ctx;
+
+    ctx = nanoid_ctx_new(alphabet, alphacnt, length);
+    if (ctx == NULL || nanoid_ctx_set_sampler(ctx, sampler) == -1) {
+        fprintf(stderr, "ERROR: failed to create context\n");
+        exit(1);
+    }
+
+    return ctx;
+}
+
+
+/*
+ * Bulk generation: every producer thread fills its own page-aligned buffer
+ * with whole records (ID and separator) in batches, and writes it out
+ * under a lock, so records never interleave, even on a pipe (whose writes
+ * beyond PIPE_BUF aren't atomic), while the other threads keep generating.
+ */
+#define STREAM_BUFSIZE  (1024 * 1024)
+
+/* Bulk generation job of a thread */
+struct stream_job {
+    pthread_t thread;
+    const struct nanoid_ctx *ctx; /* NULL for sortable IDs */
+    const unsigned char *alphabet;
+    size_t alphacnt;
+    size_t length;
+    size_t count;
+    char sep; /* record separator */
+};
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void
+stream_write(const char *buf, size_t n)
+{
+    ssize_t ret;
+
+    while (n > 0) {
+        ret = write(STDOUT_FILENO, buf, n);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: failed to write: %s\n", strerror(errno));
+            exit(1);
+        }
+        buf += ret;
+        n -= (size_t)ret;
+    }
+}
+
+
+static size_t
+stream_batch(size_t length)
+{
+    size_t n = STREAM_BUFSIZE / (length + 1);
+
+    return (n > 0) ? n : 1;
+}
+
+
+/*
+ * Generate <n> IDs into <buf> at the given <stride> with <ctx>, or
+ * sortable IDs if <ctx> is NULL.
+ */
+static void
+fill_ids(const struct nanoid_ctx *ctx, const unsigned char *alphabet,
+         size_t alphacnt, size_t length, char *buf, size_t n, size_t stride)
+{
+    size_t i;
+    void *ret;
+
+    if (ctx != NULL) {
+        ret = nanoid_ctx_generate_batch(ctx, buf, n, stride, 0);
+    } else {
+        for (i = 0, ret = buf; i < n && ret != NULL; ++i) {
+            ret = nanoid_generate_sortable(buf + i * stride, length,
+                                           alphabet, alphacnt);
+        }
+    }
+    if (ret == NULL) {
+        fprintf(stderr, "ERROR: failed to generate ID\n");
+        exit(1);
+    }
+}
+
+
+/*
+ * Create the context of the bulk generation: exact bit fields for a
+ * power-of-2 alphabet, mask otherwise; none for sortable IDs.
+ */
+static struct nanoid_ctx *
+stream_ctx(const unsigned char *alphabet, size_t alphacnt, size_t length,
+           int sortable)
+{
+    struct nanoid_ctx *ctx;
+
+    if (sortable)
+        return NULL;
+
+    ctx = nanoid_ctx_new(alphabet, alphacnt, length);
+    if (ctx == NULL) {
+        fprintf(stderr, "ERROR: failed to create context\n");
+        exit(1);
+    }
+    nanoid_ctx_set_sampler(ctx, NANOID_SAMPLER_BITS);
+
+    return ctx;
+}
+
+
+static void *
+stream_thread(void *arg)
+{
+    struct stream_job *job = arg;
+    size_t recsize, batch, done, n, i;
+    char *buf;
+    void *p;
+
+    recsize = job->length + 1;
+    batch = stream_batch(job->length);
+    if (posix_memalign(&p, 4096, batch * recsize) != 0) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    buf = p;
+
+    for (done = 0; done < job->count; done += n) {
+        n = job->count - done;
+        if (n > batch)
+            n = batch;
+
+        fill_ids(job->ctx, job->alphabet, job->alphacnt, job->length,
+                 buf, n, recsize);
+        for (i = 0; i < n; ++i)
+            buf[i * recsize + job->length] = job->sep;
+
+        pthread_mutex_lock(&stream_lock);
+        stream_write(buf, n * recsize);
+        pthread_mutex_unlock(&stream_lock);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+
+/*
+ * Write <count> IDs to stdout, separated by <sep>, with <nthreads>
+ * producer threads; the order of the IDs is unspecified.
+ */
+static int
+generate_stream(const unsigned char *alphabet, size_t alphacnt,
+                size_t length, size_t count, size_t nthreads, char sep,
+                int sortable)
+{
+    struct stream_job *jobs;
+    struct nanoid_ctx *ctx;
+    size_t batches, i;
+
+    ctx = stream_ctx(alphabet, alphacnt, length, sortable);
+
+    /* No more threads than buffers to fill */
+    batches = (count + stream_batch(length) - 1) / stream_batch(length);
+    if (nthreads > batches)
+        nthreads = batches;
+
+    jobs = calloc(nthreads, sizeof(*jobs));
+    if (jobs == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nthreads; ++i) {
+        jobs[i].ctx = ctx;
+        jobs[i].alphabet = alphabet;
+        jobs[i].alphacnt = alphacnt;
+        jobs[i].length = length;
+        jobs[i].count = count / nthreads + (i < count % nthreads);
+        jobs[i].sep = sep;
+        if (pthread_create(&jobs[i].thread, NULL, stream_thread,
+                           &jobs[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; ++i)
+        pthread_join(jobs[i].thread, NULL);
+
+    free(jobs);
+    nanoid_ctx_free(ctx);
+    return 0;
+}
+
+
+/*
+ * ID file: a header of IDFILE_HDRSIZE bytes, then <count> fixed-size
+ * records, the n-th one at offset (IDFILE_HDRSIZE + n * recsize), so that
+ * a consumer can map the file and index the IDs without parsing.  The
+ * header fields are little-endian:
+ *
+ *     0  magic "NANOIDF1"          24  ID length (32-bit)
+ *     8  header size (32-bit)      28  record size (32-bit)
+ *    12  format (32-bit)           32  alphabet size (32-bit)
+ *    16  count (64-bit)           256  alphabet (zero padded)
+ *
+ * A text record is the ID and its separator; a packed record is the
+ * nanoid_pack() output.  The file is sized with ftruncate() and filled
+ * through a shared mapping by several threads, each owning a disjoint
+ * range of records.
+ */
+#define IDFILE_MAGIC    "NANOIDF1"
+#define IDFILE_HDRSIZE  512
+
+/* ID file formats */
+enum {
+    IDFILE_TEXT,
+    IDFILE_PACKED,
+};
+
+/* ID file job of a thread */
+struct idfile_job {
+    pthread_t thread;
+    const struct nanoid_ctx *ctx; /* NULL for sortable IDs */
+    const unsigned char *alphabet;
+    size_t alphacnt;
+    const unsigned char *packalpha; /* alphabet to pack with */
+    size_t length;
+    int format;
+    char sep;
+    size_t recsize;
+    unsigned char *recs; /* first record owned */
+    size_t count;
+};
+
+
+/* ID file being written, removed if the program exits on an error */
+static const char *idfile_path;
+
+
+static void
+idfile_cleanup(void)
+{
+    if (idfile_path != NULL)
+        unlink(idfile_path);
+}
+
+
+static void
+put_le(unsigned char *p, uint64_t v, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+
+static void *
+idfile_thread(void *arg)
+{
+    struct idfile_job *job = arg;
+    size_t batch, done, n, i, len = job->length;
+    unsigned char *out;
+    char *ids = NULL;
+
+    batch = stream_batch(len);
+    if (job->format == IDFILE_PACKED) {
+        ids = malloc(batch * len);
+        if (ids == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    for (done = 0; done < job->count; done += n) {
+        n = job->count - done;
+        if (n > batch)
+            n = batch;
+        out = job->recs + done * job->recsize;
+
+        if (job->format == IDFILE_TEXT) {
+            fill_ids(job->ctx, job->alphabet, job->alphacnt, len,
+                     (char *)out, n, job->recsize);
+            for (i = 0; i < n; ++i)
+                out[i * job->recsize + len] = (unsigned char)job->sep;
+        } else {
+            fill_ids(job->ctx, job->alphabet, job->alphacnt, len, ids, n,
+                     len);
+            if (nanoid_pack_batch(out, ids, n, len, 0, job->packalpha,
+                                  strlen((const char *)job->packalpha))
+                == NULL) {
+                fprintf(stderr, "ERROR: failed to pack IDs\n");
+                exit(1);
+            }
+        }
+    }
+
+    free(ids);
+    return NULL;
+}
+
+
+/*
+ * Write <count> IDs into the ID file <path> of format <format>, with
+ * <nthreads> threads.
+ */
+static int
+generate_file(const char *path, int format, const unsigned char *alphabet,
+              size_t alphacnt, size_t length, size_t count,
+              size_t nthreads, char sep, int sortable)
+{
+    struct idfile_job *jobs;
+    struct nanoid_ctx *ctx;
+    const unsigned char *fullalpha;
+    unsigned char *map;
+    char *trial;
+    size_t recsize, size, start, end, i, fullcnt;
+    int fd;
+
+    /* The alphabet actually used, for the header and the packing */
+    if (alphabet != NULL)
+        fullalpha = alphabet;
+    else if (sortable)
+        fullalpha = (const unsigned char *)NANOID_SORTABLE_ALPHABET;
+    else
+        fullalpha = (const unsigned char *)NANOID_ALPHABET;
+    fullcnt = strlen((const char *)fullalpha);
+
+    /*
+     * Check everything before touching the file: the alphabet must fit
+     * the header, and be valid for the (sortable) IDs.
+     */
+    if (fullcnt > 255) {
+        fprintf(stderr, "ERROR: invalid alphabet\n");
+        exit(1);
+    }
+    ctx = stream_ctx(alphabet, alphacnt, length, sortable);
+    if (sortable) {
+        trial = malloc(length);
+        if (trial == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory\n");
+            exit(1);
+        }
+        fill_ids(NULL, alphabet, alphacnt, length, trial, 1, length);
+        free(trial);
+    }
+
+    if (format == IDFILE_TEXT) {
+        recsize = length + 1;
+    } else {
+        recsize = nanoid_packed_size(length, fullalpha, fullcnt);
+        if (recsize == 0) {
+            fprintf(stderr, "ERROR: packed format requires an alphabet "
+                    "whose size is a power of 2\n");
+            exit(1);
+        }
+    }
+    if (count > (SIZE_MAX - IDFILE_HDRSIZE) / recsize ||
+        recsize > UINT32_MAX || length > UINT32_MAX) {
+        fprintf(stderr, "ERROR: file too large\n");
+        exit(1);
+    }
+    size = IDFILE_HDRSIZE + count * recsize;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        idfile_path = path;
+        atexit(idfile_cleanup);
+    }
+    if (fd == -1 || ftruncate(fd, (off_t)size) == -1) {
+        fprintf(stderr, "ERROR: failed to create %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "ERROR: failed to map %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+
+    memcpy(map, IDFILE_MAGIC, 8);
+    put_le(map + 8, IDFILE_HDRSIZE, 4);
+    put_le(map + 12, (uint64_t)format, 4);
+    put_le(map + 16, count, 8);
+    put_le(map + 24, length, 4);
+    put_le(map + 28, recsize, 4);
+    put_le(map + 32, fullcnt, 4);
+    memcpy(map + 256, fullalpha, fullcnt);
+
+    if (nthreads > count)
+        nthreads = count;
+    jobs = calloc(nthreads, sizeof(*jobs));
+    if (jobs == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nthreads; ++i) {
+        start = count / nthreads * i + (i < count % nthreads ? i :
+                                        count % nthreads);
+        end = start + count / nthreads + (i < count % nthreads);
+        jobs[i].ctx = ctx;
+        jobs[i].alphabet = alphabet;
+        jobs[i].alphacnt = alphacnt;
+        jobs[i].packalpha = fullalpha;
+        jobs[i].length = length;
+        jobs[i].format = format;
+        jobs[i].sep = sep;
+        jobs[i].recsize = recsize;
+        jobs[i].recs = map + IDFILE_HDRSIZE + start * recsize;
+        jobs[i].count = end - start;
+        if (pthread_create(&jobs[i].thread, NULL, idfile_thread,
+                           &jobs[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; ++i)
+        pthread_join(jobs[i].thread, NULL);
+
+    if (munmap(map, size) == -1 || close(fd) == -1) {
+        fprintf(stderr, "ERROR: failed to write %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    idfile_path = NULL;
+
+    free(jobs);
+    nanoid_ctx_free(ctx);
+    return 0;
+}
+
+
+static int
+cmd_generate(int argc, char *argv[])
+{
+    const char *alphabet, *output;
+    char *buf, *endp;
+    size_t length, count, nthreads;
+    long ncpus;
+    int opt, sortable, nul, format;
+    void *ret;
+
+    alphabet = NULL;
+    length = NANOID_SIZE;
+    sortable = 0;
+    count = 0;
+    nul = 0;
+    output = NULL;
+    format = -1;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (ncpus > 0) ? (size_t)ncpus : 1;
+
+    while ((opt = getopt(argc, argv, "0Ta:f:l:n:o:t:")) != -1) {
+        switch (opt) {
+        case '0':
+            nul = 1;
+            break;
+        case 'T':
+            sortable = 1;
+            break;
+        case 'a':
+            alphabet = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) {
+                format = IDFILE_TEXT;
+            } else if (strcmp(optarg, "packed") == 0) {
+                format = IDFILE_PACKED;
+            } else {
+                fprintf(stderr, "ERROR: invalid format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            length = (size_t)strtoul(optarg, &endp, 10);
+            if (length == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid length: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'n':
+            count = (size_t)strtoull(optarg, &endp, 10);
+            if (count == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid count: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            nthreads = (size_t)strtoul(optarg, &endp, 10);
+            if (nthreads == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid threads: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc != optind)
+        usage();
+    if (format != -1 && output == NULL) {
+        fprintf(stderr, "ERROR: -f requires -o\n");
+        exit(1);
+    }
+
+    if (output != NULL) {
+        return generate_file(output, (format == -1) ? IDFILE_TEXT : format,
+                             (const unsigned char *)alphabet,
+                             alphabet ? strlen(alphabet) : 0, length,
+                             count ? count : 1, nthreads,
+                             nul ? '\0' : '\n', sortable);
+    }
+    if (count > 0 || nul) {
+        return generate_stream((const unsigned char *)alphabet,
+                               alphabet ? strlen(alphabet) : 0, length,
+                               count ? count : 1, nthreads,
+                               nul ? '\0' : '\n', sortable);
+    }
+
+    buf = malloc(length);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+
+    if (sortable) {
+        ret = nanoid_generate_sortable(buf, length,
+                                       (const unsigned char *)alphabet,
+                                       alphabet ? strlen(alphabet) : 0);
+    } else {
+        ret = nanoid_generate_r(buf, length, (const unsigned char *)alphabet,
+                                alphabet ? strlen(alphabet) : 0);
+    }
+    if (ret == NULL) {
+        fprintf(stderr, "ERROR: failed to generate ID\n");
+        exit(1);
+    }
+
+    printf("%.*s\n", (int)length, buf);
+    free(buf);
+
+    return 0;
+}
+
+
+/* Speed test configuration */
+struct speed_conf {
+    const unsigned char *alphabet;
+    size_t alphacnt;
+    size_t length;
+    size_t batch; /* IDs per batch call; 0 to generate one by one */
+    struct nanoid_ctx *ctx; /* precompiled context; NULL if not used */
+    int use_ctx;
+    int sampler;
+    size_t pool_size; /* capacity of the ID pool; 0 if not used */
+    struct nanoid_pool *pool;
+    int sortable; /* generate sortable IDs */
+};
+
+/* Speed test result */
+struct speed_result {
+    size_t time; /* total time in ns */
+    struct nanoid_stats stats;
+    struct nanoid_pool_stats pool; /* refills/underflows during the run */
+};
+
+
+/*
+ * Generate <count> IDs into <buf> as configured by <conf>.
+ */
+static void
+speed_run(const struct speed_conf *conf, char *buf, size_t count)
+{
+    size_t i, n;
+
+    if (conf->sortable) {
+        for (i = 0; i < count; ++i) {
+            nanoid_generate_sortable(buf, conf->length, conf->alphabet,
+                                     conf->alphacnt);
+        }
+        return;
+    }
+
+    if (conf->pool != NULL) {
+        for (i = 0; i < count; ++i)
+            nanoid_pool_take(conf->pool, buf);
+        return;
+    }
+
+    if (conf->batch == 0) {
+        for (i = 0; i < count; ++i) {
+            if (conf->ctx != NULL)
+                nanoid_ctx_generate(conf->ctx, buf);
+            else
+                nanoid_generate_r(buf, conf->length, conf->alphabet,
+                                  conf->alphacnt);
+            (void)buf;
+        }
+        return;
+    }
+
+    for (i = 0; i < count; i += n) {
+        n = (count - i < conf->batch) ? count - i : conf->batch;
+        if (conf->ctx != NULL)
+            nanoid_ctx_generate_batch(conf->ctx, buf, n, 0, 0);
+        else
+            nanoid_generate_batch(buf, n, conf->length, 0, 0,
+                                  conf->alphabet, conf->alphacnt);
+        (void)buf;
+    }
+}
+
+
+/*
+ * Set up the context and pool of <conf> for IDs of length <length>.
+ */
+static void
+speed_setup(struct speed_conf *conf, size_t length)
+{
+    conf->length = length;
+    if (conf->use_ctx) {
+        conf->ctx = new_ctx(conf->alphabet, conf->alphacnt, conf->length,
+                            conf->sampler);
+    }
+    if (conf->pool_size > 0) {
+        conf->pool = nanoid_pool_new(conf->ctx, conf->pool_size, 0);
+        if (conf->pool == NULL) {
+            fprintf(stderr, "ERROR: failed to create pool\n");
+            exit(1);
+        }
+    }
+}
+
+
+static void
+speed_teardown(struct speed_conf *conf)
+{
+    nanoid_pool_free(conf->pool);
+    conf->pool = NULL;
+    nanoid_ctx_free(conf->ctx);
+    conf->ctx = NULL;
+}
+
+
+static char *
+speed_buffer(const struct speed_conf *conf)
+{
+    char *buf;
+
+    buf = malloc(conf->length * (conf->batch ? conf->batch : 1));
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+
+    return buf;
+}
+
+
+/*
+ * Burn in and run the speed test of <count> IDs of length <length>.
+ */
+static void
+speed_measure(struct speed_conf *conf, size_t length, size_t count,
+              size_t burnin, struct speed_result *res, int verbose)
+{
+    struct timespec tstart, tend;
+    struct nanoid_pool_stats pst;
+    char *buf;
+
+    speed_setup(conf, length);
+    buf = speed_buffer(conf);
+
+    if (verbose)
+        printf("Burning in ... (n=%zu)\n", burnin);
+    speed_run(conf, buf, burnin);
+
+    if (verbose)
+        printf("Running speed test ... (n=%zu)\n", count);
+    memset(&pst, 0, sizeof(pst));
+    if (conf->pool != NULL)
+        nanoid_pool_get_stats(conf->pool, &pst);
+    nanoid_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    speed_run(conf, buf, count);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    nanoid_get_stats(&res->stats);
+    res->time = timespec_diff(&tend, &tstart);
+    if (conf->pool != NULL) {
+        nanoid_pool_get_stats(conf->pool, &res->pool);
+        res->pool.refills -= pst.refills;
+        res->pool.refilled -= pst.refilled;
+        res->pool.underflows -= pst.underflows;
+    }
+
+    free(buf);
+    speed_teardown(conf);
+}
+
+
+/*
+ * Latency histogram with HDR-style log-linear buckets: values below
+ * 2 * HIST_SUB are counted exactly, larger ones in HIST_SUB buckets per
+ * power of 2, i.e., with a relative error below 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total; /* samples */
+    uint64_t sum; /* of the values */
+    uint64_t max;
+};
+
+/* Latency report formats */
+enum {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+};
+
+
+static inline size_t
+hist_index(uint64_t v)
+{
+    unsigned int shift;
+
+    if (v < 2 * HIST_SUB)
+        return (size_t)v;
+    shift = (unsigned int)(63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+    return (size_t)shift * HIST_SUB + (size_t)(v >> shift);
+}
+
+
+/*
+ * Lowest and highest values of bucket <i>.
+ */
+static void
+hist_range(size_t i, uint64_t *lo, uint64_t *hi)
+{
+    unsigned int shift;
+
+    if (i < 2 * HIST_SUB) {
+        *lo = *hi = i;
+        return;
+    }
+    shift = (unsigned int)(i / HIST_SUB) - 1;
+    *lo = (uint64_t)(i - shift * HIST_SUB) << shift;
+    *hi = *lo + ((uint64_t)1 << shift) - 1;
+}
+
+
+static inline void
+hist_add(struct histogram *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+
+/*
+ * Value at the quantile <q>: the highest value of the bucket holding it
+ * (capped at the maximum).
+ */
+static uint64_t
+hist_quantile(const struct histogram *h, double q)
+{
+    unsigned long long rank, n = 0;
+    uint64_t lo, hi;
+    size_t i;
+
+    rank = (unsigned long long)(q * (double)h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        n += h->counts[i];
+        if (n >= rank) {
+            hist_range(i, &lo, &hi);
+            return (hi < h->max) ? hi : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+static int
+parse_format(const char *name)
+{
+    if (strcmp(name, "text") == 0) {
+        return FORMAT_TEXT;
+    } else if (strcmp(name, "csv") == 0) {
+        return FORMAT_CSV;
+    } else if (strcmp(name, "json") == 0) {
+        return FORMAT_JSON;
+    } else {
+        fprintf(stderr, "ERROR: invalid format: %s\n", name);
+        exit(1);
+    }
+}
+
+
+/*
+ * Time <count> samples of <group> calls each with the cycle counter, and
+ * print the percentiles of the latency per call, and the histogram for the
+ * CSV and JSON formats.
+ */
+static void
+speed_latency(struct speed_conf *conf, size_t length, size_t count,
+              size_t burnin, size_t group, int format)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    static const char *const qnames[] = {
+        "p50", "p90", "p99", "p99.9", "p99.99",
+    };
+    struct timespec tstart, tend;
+    struct histogram *h;
+    uint64_t t0, t1, tickstart, overhead;
+    size_t skipped = 0; /* samples with the counter going backwards */
+    double ns; /* per tick and call */
+    size_t i, nq = sizeof(quantiles) / sizeof(quantiles[0]);
+    uint64_t lo, hi;
+    char *buf;
+    int first;
+
+    h = calloc(1, sizeof(*h));
+    if (h == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    speed_setup(conf, length);
+    buf = speed_buffer(conf);
+    speed_run(conf, buf, burnin);
+
+    /* Cost of a counter read, as the minimum of back-to-back reads */
+    overhead = UINT64_MAX;
+    for (i = 0; i < 1000; ++i) {
+        t0 = timer_read();
+        t1 = timer_read();
+        if (t1 - t0 < overhead)
+            overhead = t1 - t0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    tickstart = timer_read();
+    t0 = tickstart;
+    for (i = 0; i < count; ++i) {
+        speed_run(conf, buf, group);
+        t1 = timer_read();
+        /* The counter may go backwards after a migration between CPUs */
+        if (t1 >= t0)
+            hist_add(h, t1 - t0);
+        else
+            skipped++;
+        t0 = t1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    if (h->total == 0) {
+        fprintf(stderr, "ERROR: no valid latency samples\n");
+        exit(1);
+    }
+    ns = (double)timespec_diff(&tend, &tstart) /
+         (double)(timer_read() - tickstart) / (double)group;
+
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("Latency: %zu samples of %zu call(s), timer %s "
+               "(%.3f ns/tick, overhead %.1f ns)\n", count, group,
+               TIMER_NAME, ns * (double)group, ns * (double)overhead *
+               (double)group);
+        if (skipped > 0) {
+            printf("Skipped: %zu samples (timer went backwards)\n",
+                   skipped);
+        }
+        printf("%10s", "mean");
+        for (i = 0; i < nq; ++i)
+            printf(" %10s", qnames[i]);
+        printf(" %10s\n", "max");
+        printf("%10.1f", ns * (double)h->sum / (double)h->total);
+        for (i = 0; i < nq; ++i)
+            printf(" %10.1f", ns * (double)hist_quantile(h, quantiles[i]));
+        printf(" %10.1f  (ns/call)\n", ns * (double)h->max);
+        break;
+
+    case FORMAT_CSV:
+        printf("source,kernel,length,group,samples,lo_ns,hi_ns,count\n");
+        for (i = 0; i < HIST_BUCKETS; ++i) {
+            if (h->counts[i] == 0)
+                continue;
+            hist_range(i, &lo, &hi);
+            printf("%s,%s,%zu,%zu,%zu,%.1f,%.1f,%llu\n",
+                   nanoid_get_random_source(), nanoid_get_kernel(),
+                   length, group, count, ns * (double)lo,
+                   ns * (double)(hi + 1), h->counts[i]);
+        }
+        break;
+
+    case FORMAT_JSON:
+        printf("{\"source\": \"%s\", \"kernel\": \"%s\", \"length\": %zu, "
+               "\"group\": %zu, \"samples\": %zu, \"skipped\": %zu, "
+               "\"timer\": \"%s\", \"overhead_ns\": %.1f,\n",
+               nanoid_get_random_source(), nanoid_get_kernel(), length,
+               group, count, skipped, TIMER_NAME,
+               ns * (double)overhead * (double)group);
+        printf(" \"mean_ns\": %.1f", ns * (double)h->sum / (double)h->total);
+        for (i = 0; i < nq; ++i) {
+            printf(", \"%s_ns\": %.1f", qnames[i],
+                   ns * (double)hist_quantile(h, quantiles[i]));
+        }
+        printf(", \"max_ns\": %.1f,\n \"histogram\": [", ns * (double)h->max);
+        for (i = 0, first = 1; i < HIST_BUCKETS; ++i) {
+            if (h->counts[i] == 0)
+                continue;
+            hist_range(i, &lo, &hi);
+            printf("%s\n  [%.1f, %.1f, %llu]", first ? "" : ",",
+                   ns * (double)lo, ns * (double)(hi + 1), h->counts[i]);
+            first = 0;
+        }
+        printf("\n ]}\n");
+        break;
+    }
+
+    free(buf);
+    speed_teardown(conf);
+    free(h);
+}
+
+
+/* Start gate of the scaling speed test */
+struct speed_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t ready; /* threads done with the burn-in */
+    int go;
+};
+
+/* Thread of the scaling speed test */
+struct speed_thread {
+    pthread_t thread;
+    const struct speed_conf *conf;
+    struct speed_gate *gate;
+    long cpu; /* CPU to pin to; -1 if not pinned */
+    size_t count;
+    size_t burnin;
+    size_t time; /* in ns */
+};
+
+
+static void *
+speed_thread_run(void *arg)
+{
+    struct speed_thread *st = arg;
+    struct speed_gate *gate = st->gate;
+    struct timespec tstart, tend;
+    char *buf;
+
+#ifdef HAVE_AFFINITY
+    cpu_set_t cpus;
+
+    if (st->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET((size_t)st->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                   &cpus) != 0) {
+            fprintf(stderr, "ERROR: failed to pin thread to CPU %ld\n",
+                    st->cpu);
+            exit(1);
+        }
+    }
+#endif
+
+    buf = speed_buffer(st->conf);
+    speed_run(st->conf, buf, st->burnin);
+
+    pthread_mutex_lock(&gate->lock);
+    gate->ready++;
+    pthread_cond_broadcast(&gate->cond);
+    while (!gate->go)
+        pthread_cond_wait(&gate->cond, &gate->lock);
+    pthread_mutex_unlock(&gate->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    speed_run(st->conf, buf, st->count);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+    st->time = timespec_diff(&tend, &tstart);
+
+    free(buf);
+    return NULL;
+}
+
+
+/*
+ * Run <nthreads> threads generating <count> IDs each, released together
+ * after their burn-in; threads are pinned to CPUs 0, 1, ... (wrapping
+ * around) if <pin>.  Returns the wall time in ns, and fills <threads>.
+ */
+static size_t
+speed_threads(const struct speed_conf *conf, size_t nthreads, size_t count,
+              size_t burnin, int pin, struct speed_thread *threads)
+{
+    struct speed_gate gate;
+    struct timespec tstart, tend;
+    long ncpus;
+    size_t i;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+
+    memset(&gate, 0, sizeof(gate));
+    pthread_mutex_init(&gate.lock, NULL);
+    pthread_cond_init(&gate.cond, NULL);
+
+    for (i = 0; i < nthreads; ++i) {
+        threads[i].conf = conf;
+        threads[i].gate = &gate;
+        threads[i].cpu = pin ? (long)i % ncpus : -1;
+        threads[i].count = count;
+        threads[i].burnin = burnin;
+        if (pthread_create(&threads[i].thread, NULL, speed_thread_run,
+                           &threads[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            exit(1);
+        }
+    }
+
+    pthread_mutex_lock(&gate.lock);
+    while (gate.ready < nthreads)
+        pthread_cond_wait(&gate.cond, &gate.lock);
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    gate.go = 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
+
+    for (i = 0; i < nthreads; ++i)
+        pthread_join(threads[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.lock);
+    return timespec_diff(&tend, &tstart);
+}
+
+
+/*
+ * Run the speed test with 1..<nthreads> threads, each generating <count>
+ * IDs, and print the aggregate and per-thread rates, the speedup and the
+ * efficiency over one thread, then the rate of every thread of the last
+ * run.
+ */
+static void
+speed_scaling(struct speed_conf *conf, size_t length, size_t nthreads,
+              size_t count, size_t burnin, int pin)
+{
+    struct speed_thread *threads;
+    double rate, base, tmin, tmax;
+    size_t n, i, wall;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+
+    speed_setup(conf, length);
+    printf("Scaling: 1..%zu threads, %zu IDs/thread%s\n",
+           nthreads, count, pin ? ", pinned" : "");
+    printf("%8s %12s %12s %12s %12s %8s %10s\n", "threads", "id/s",
+           "id/s/thread", "min", "max", "speedup", "efficiency");
+
+    base = 0;
+    for (n = 1; n <= nthreads; ++n) {
+        wall = speed_threads(conf, n, count, burnin, pin, threads);
+        rate = 1e9 * (double)(count * n) / (double)wall;
+        if (n == 1)
+            base = rate;
+
+        tmin = tmax = (double)threads[0].time;
+        for (i = 1; i < n; ++i) {
+            if ((double)threads[i].time < tmin)
+                tmin = (double)threads[i].time;
+            if ((double)threads[i].time > tmax)
+                tmax = (double)threads[i].time;
+        }
+        printf("%8zu %12.0f %12.0f %12.0f %12.0f %8.2f %9.1f%%\n",
+               n, rate, rate / (double)n, 1e9 * (double)count / tmax,
+               1e9 * (double)count / tmin, rate / base,
+               100.0 * rate / (base * (double)n));
+    }
+
+    printf("Threads of the %zu-thread run:\n", nthreads);
+    for (i = 0; i < nthreads; ++i) {
+        printf("%8zu %12.0f id/s", i,
+               1e9 * (double)count / (double)threads[i].time);
+        if (threads[i].cpu >= 0)
+            printf(" (CPU %ld)", threads[i].cpu);
+        putchar('\n');
+    }
+
+    speed_teardown(conf);
+    free(threads);
+}
+
+
+/*
+ * Run the speed test over the ID lengths 8..4096, with the iterations
+ * scaled down for longer IDs, and print a table.
+ */
+static void
+speed_matrix(struct speed_conf *conf, size_t count, size_t burnin)
+{
+    struct speed_result res;
+    size_t length, n;
+
+    printf("%8s %10s %10s %11s %14s\n",
+           "length", "ns/id", "bytes/id", "refills/id", "bytes/syscall");
+    for (length = 8; length <= 4096; length *= 2) {
+        n = count * NANOID_SIZE / length;
+        if (n < 1000)
+            n = 1000;
+        speed_measure(conf, length, n, burnin * n / count, &res, 0);
+        printf("%8zu %10zu %10.2f %11.3f ", length, res.time / n,
+               (double)res.stats.random_bytes / (double)n,
+               (double)res.stats.random_calls / (double)n);
+        if (res.stats.source_calls > 0) {
+            printf("%14.1f\n", (double)res.stats.random_bytes /
+                                (double)res.stats.source_calls);
+        } else {
+            printf("%14s\n", "-");
+        }
+    }
+}
+
+
+/* Leaf page of the simulated B+tree */
+struct leaf {
+    size_t n;
+    char keys[];
+};
+
+/* Leaf level of the simulated B+tree */
+struct leaves {
+    size_t len; /* key length */
+    size_t cap; /* keys per page */
+    size_t npages;
+    size_t maxpages;
+    struct leaf **pages; /* in key order */
+    size_t splits;
+    size_t appends; /* keys greater than all the previous ones */
+};
+
+
+static struct leaf *
+leaf_new(const struct leaves *lv)
+{
+    struct leaf *pg;
+
+    pg = malloc(sizeof(*pg) + lv->cap * lv->len);
+    if (pg == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    pg->n = 0;
+    return pg;
+}
+
+
+/*
+ * Insert page <pg> at position <i> of the leaf level.
+ */
+static void
+leaves_add(struct leaves *lv, size_t i, struct leaf *pg)
+{
+    if (lv->npages == lv->maxpages) {
+        lv->maxpages = lv->maxpages ? lv->maxpages * 2 : 64;
+        lv->pages = realloc(lv->pages, lv->maxpages * sizeof(*lv->pages));
+        if (lv->pages == NULL) {
+            fprintf(stderr, "ERROR: failed to allocate memory\n");
+            exit(1);
+        }
+    }
+    memmove(&lv->pages[i + 1], &lv->pages[i],
+            (lv->npages - i) * sizeof(*lv->pages));
+    lv->pages[i] = pg;
+    lv->npages++;
+}
+
+
+/*
+ * Insert <key> into the leaf level.  A full page is split in halves, or
+ * at the insertion point when appending to the rightmost page (as most
+ * databases do for sequential keys).
+ */
+static void
+leaves_insert(struct leaves *lv, const char *key)
+{
+    struct leaf *pg, *npg;
+    size_t lo, hi, mid, i, pos, half, len = lv->len;
+
+    if (lv->npages == 0)
+        leaves_add(lv, 0, leaf_new(lv));
+
+    /* Last page whose first key is <= key */
+    lo = 0;
+    hi = lv->npages;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (memcmp(lv->pages[mid]->keys, key, len) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    i = lo;
+    pg = lv->pages[i];
+
+    lo = 0;
+    hi = pg->n;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (memcmp(pg->keys + mid * len, key, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    pos = lo;
+
+    if (i == lv->npages - 1 && pos == pg->n)
+        lv->appends++;
+
+    if (pg->n == lv->cap) {
+        lv->splits++;
+        npg = leaf_new(lv);
+        half = (i == lv->npages - 1 && pos == pg->n) ? pg->n : pg->n / 2;
+        npg->n = pg->n - half;
+        memcpy(npg->keys, pg->keys + half * len, npg->n * len);
+        pg->n = half;
+        leaves_add(lv, i + 1, npg);
+        if (pos >= half) {
+            pg = npg;
+            pos -= half;
+        }
+    }
+
+    memmove(pg->keys + (pos + 1) * len, pg->keys + pos * len,
+            (pg->n - pos) * len);
+    memcpy(pg->keys + pos * len, key, len);
+    pg->n++;
+}
+
+
+/*
+ * Generate <count> IDs as configured by <conf>, insert them in order into
+ * a simulated B+tree leaf level of 8 KiB pages, and print the share of
+ * appends, the page splits and fill factor, and the insert time.
+ */
+static void
+speed_insert(struct speed_conf *conf, size_t count)
+{
+    struct timespec tstart, tend;
+    struct leaves lv;
+    char *ids;
+    size_t i, len = conf->length;
+
+    ids = malloc(count * len);
+    if (ids == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    if (conf->use_ctx) {
+        conf->ctx = new_ctx(conf->alphabet, conf->alphacnt, len,
+                            conf->sampler);
+    }
+    for (i = 0; i < count; ++i)
+        speed_run(conf, ids + i * len, 1);
+    nanoid_ctx_free(conf->ctx);
+    conf->ctx = NULL;
+
+    memset(&lv, 0, sizeof(lv));
+    lv.len = len;
+    lv.cap = 8192 / len;
+    if (lv.cap < 4)
+        lv.cap = 4;
+
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    for (i = 0; i < count; ++i)
+        leaves_insert(&lv, ids + i * len);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+
+    printf("Insert: %zu ns/key, %.1f%% appends, %zu page splits, "
+           "%.1f%% page fill\n",
+           timespec_diff(&tend, &tstart) / count,
+           100.0 * (double)lv.appends / (double)count, lv.splits,
+           100.0 * (double)count / (double)(lv.npages * lv.cap));
+
+    for (i = 0; i < lv.npages; ++i)
+        free(lv.pages[i]);
+    free(lv.pages);
+    free(ids);
+}
+
+
+/*
+ * Generate <count> IDs as configured by <conf>, then pack and unpack them
+ * in a batch, check the round trip, and print the times and packed size.
+ */
+static void
+speed_pack(struct speed_conf *conf, size_t count)
+{
+    struct timespec t0, t1, t2;
+    char *ids, *out;
+    unsigned char *packed;
+    size_t i, size, len = conf->length;
+
+    size = nanoid_packed_size(len, conf->alphabet, conf->alphacnt);
+    if (size == 0) {
+        fprintf(stderr, "ERROR: alphabet size is not a power of 2\n");
+        exit(1);
+    }
+
+    ids = malloc(count * len);
+    out = malloc(count * len);
+    packed = malloc(count * size);
+    if (ids == NULL || out == NULL || packed == NULL) {
+        fprintf(stderr, "ERROR: failed to allocate memory\n");
+        exit(1);
+    }
+    if (conf->use_ctx) {
+        conf->ctx = new_ctx(conf->alphabet, conf->alphacnt, len,
+                            conf->sampler);
+    }
+    for (i = 0; i < count; ++i)
+        speed_run(conf, ids + i * len, 1);
+    nanoid_ctx_free(conf->ctx);
+    conf->ctx = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (nanoid_pack_batch(packed, ids, count, len, 0, conf->alphabet,
+                          conf->alphacnt) == NULL) {
+        fprintf(stderr, "ERROR: failed to pack IDs\n");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (nanoid_unpack_batch(out, count, len, 0, 0, packed, conf->alphabet,
+                            conf->alphacnt) == NULL) {
+        fprintf(stderr, "ERROR: failed to unpack IDs\n");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    if (memcmp(ids, out, count * len) != 0) {
+        fprintf(stderr, "ERROR: unpacked IDs differ\n");
+        exit(1);
+    }
+
+    printf("Pack: %zu bytes/id, pack %zu ns/id, unpack %zu ns/id\n",
+           size, timespec_diff(&t1, &t0) / count,
+           timespec_diff(&t2, &t1) / count);
+
+    free(packed);
+    free(out);
+    free(ids);
+}
+
+
+static int
+cmd_speed(int argc, char *argv[])
+{
+    struct speed_conf conf;
+    struct speed_result res;
+    size_t count, burnin, length;
+    char *endp;
+    size_t nthreads, group;
+    int opt, matrix, insert, pack, pin, latency, format;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.sampler = NANOID_SAMPLER_MASK;
+    length = NANOID_SIZE;
+    count = speed_count;
+    burnin = 0;
+    matrix = 0;
+    insert = 0;
+    pack = 0;
+    nthreads = 0;
+    pin = 0;
+    latency = 0;
+    group = 1;
+    format = FORMAT_TEXT;
+
+    while ((opt = getopt(argc, argv,
+                         "B:CHIKLP:Ta:b:c:e:f:g:k:l:m:ps:t:")) != -1) {
+        switch (opt) {
+        case 'B':
+            conf.batch = (size_t)strtoul(optarg, &endp, 10);
+            if (conf.batch == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid batch: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'C':
+            conf.use_ctx = 1;
+            break;
+        case 'H':
+            latency = 1;
+            break;
+        case 'I':
+            insert = 1;
+            break;
+        case 'K':
+            pack = 1;
+            break;
+        case 'L':
+            matrix = 1;
+            break;
+        case 'P':
+            conf.pool_size = (size_t)strtoul(optarg, &endp, 10);
+            if (conf.pool_size == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid pool size: %s\n", optarg);
+                exit(1);
+            }
+            conf.use_ctx = 1;
+            break;
+        case 'T':
+            conf.sortable = 1;
+            break;
+        case 'a':
+            conf.alphabet = (const unsigned char *)optarg;
+            conf.alphacnt = strlen(optarg);
+            break;
+        case 'b':
+            burnin = (size_t)strtoul(optarg, &endp, 10);
+            if (burnin == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid burnin: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            count = (size_t)strtoul(optarg, &endp, 10);
+            if (count == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid count: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'e':
+            set_engine(optarg);
+            break;
+        case 'f':
+            format = parse_format(optarg);
+            break;
+        case 'g':
+            group = (size_t)strtoul(optarg, &endp, 10);
+            if (group == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid group: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            set_kernel(optarg);
+            break;
+        case 'l':
+            length = (size_t)strtoul(optarg, &endp, 10);
+            if (length == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid length: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            conf.sampler = parse_sampler(optarg);
+            conf.use_ctx = 1;
+            break;
+        case 'p':
+#ifndef HAVE_AFFINITY
+            fprintf(stderr, "ERROR: CPU pinning is not supported\n");
+            exit(1);
+#endif
+            pin = 1;
+            break;
+        case 's':
+            set_source(optarg);
+            break;
+        case 't':
+            nthreads = (size_t)strtoul(optarg, &endp, 10);
+            if (nthreads == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid threads: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc != optind)
+        usage();
+    if (conf.sortable && (conf.use_ctx || conf.batch > 0)) {
+        fprintf(stderr, "ERROR: -T cannot be used with -B, -C, -P or -m\n");
+        exit(1);
+    }
+    if (nthreads > 0 && (insert || pack || matrix)) {
+        fprintf(stderr, "ERROR: -t cannot be used with -I, -K or -L\n");
+        exit(1);
+    }
+    if (pin && nthreads == 0) {
+        fprintf(stderr, "ERROR: -p requires -t\n");
+        exit(1);
+    }
+    if (latency && (nthreads > 0 || insert || pack || matrix)) {
+        fprintf(stderr, "ERROR: -H cannot be used with -I, -K, -L or -t\n");
+        exit(1);
+    }
+
+    if (burnin == 0)
+        burnin = count / 10;
+
+    if (latency && format != FORMAT_TEXT) {
+        speed_latency(&conf, length, count, burnin, group, format);
+        return 0;
+    }
+    printf("Source: %s\n", nanoid_get_random_source());
+    printf("Kernel: %s\n", nanoid_get_kernel());
+    if (latency) {
+        speed_latency(&conf, length, count, burnin, group, format);
+        return 0;
+    }
+    if (matrix) {
+        speed_matrix(&conf, count, burnin);
+        return 0;
+    }
+    if (nthreads > 0) {
+        speed_scaling(&conf, length, nthreads, count, burnin, pin);
+        return 0;
+    }
+
+    speed_measure(&conf, length, count, burnin, &res, 1);
+    printf("Speed: %zu ns/id, %zu id/s\n",
+           res.time / count, 1000000000UL * count / res.time);
+    printf("Random: %.2f bytes/id, %.3f refills/id\n",
+           (double)res.stats.random_bytes / (double)count,
+           (double)res.stats.random_calls / (double)count);
+    if (conf.pool_size > 0) {
+        printf("Pool: %llu refills, %llu IDs refilled, %llu underflows\n",
+               res.pool.refills, res.pool.refilled, res.pool.underflows);
+    }
+    if (insert)
+        speed_insert(&conf, count);
+    if (pack)
+        speed_pack(&conf, count);
+
+    return 0;
+}
+
+
+/*
+ * Benchmark matrix: every API variant over a set of ID lengths and
+ * alphabet sizes.  Every configuration is calibrated to trials of about
+ * <duration> ms, warmed up until two trials in a row agree within 2%,
+ * then timed over <trials> trials, reported as median and MAD (median
+ * absolute deviation) in ns/id.  It's then timed again with the seeded
+ * source, whose cost is negligible, so the difference splits the time
+ * between the random source (entropy) and the rest (mapping).
+ */
+#define BENCH_MAX_LIST      32
+#define BENCH_MAX_WARMUPS   20
+#define BENCH_STABLE        0.02 /* relative change of a stable warm-up */
+#define BENCH_BATCH         128 /* IDs per call of the batch variants */
+
+/* API variants of the benchmark */
+static const struct {
+    const char *name;
+    int use_ctx;
+    int batch;
+} bench_variants[] = {
+    { "generate_r",         0, 0 },
+    { "generate_batch",     0, 1 },
+    { "ctx_generate",       1, 0 },
+    { "ctx_generate_batch", 1, 1 },
+};
+#define BENCH_NVARIANTS (sizeof(bench_variants) / sizeof(bench_variants[0]))
+
+/* Median and MAD of the trials of a configuration */
+struct bench_stat {
+    double median; /* ns/id */
+    double mad;
+    size_t warmups;
+};
+
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static double
+median(double *v, size_t n)
+{
+    qsort(v, n, sizeof(*v), cmp_double);
+    return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+/*
+ * Parse the comma-separated list <s> of numbers within [<min>, <max>]
+ * into <vals>; returns the number of values.
+ */
+static size_t
+parse_list(const char *s, size_t *vals, size_t min, size_t max,
+           const char *what)
+{
+    const char *p = s;
+    char *endp;
+    size_t n = 0;
+    unsigned long v;
+
+    for (;;) {
+        v = strtoul(p, &endp, 10);
+        if (endp == p || v < min || v > max || n == BENCH_MAX_LIST ||
+            (*endp != ',' && *endp != '\0')) {
+            fprintf(stderr, "ERROR: invalid %s: %s\n", what, s);
+            exit(1);
+        }
+        vals[n++] = (size_t)v;
+        if (*endp == '\0')
+            return n;
+        p = endp + 1;
+    }
+}
+
+
+/*
+ * Parse the comma-separated list <s> of variant names into a bit mask.
+ */
+static unsigned int
+parse_variants(const char *s)
+{
+    const char *p = s;
+    unsigned int mask = 0;
+    size_t n, i;
+
+    for (;;) {
+        n = strcspn(p, ",");
+        for (i = 0; i < BENCH_NVARIANTS; ++i) {
+            if (strlen(bench_variants[i].name) == n &&
+                strncmp(p, bench_variants[i].name, n) == 0)
+                break;
+        }
+        if (i == BENCH_NVARIANTS) {
+            fprintf(stderr, "ERROR: invalid variants: %s\n", s);
+            exit(1);
+        }
+        mask |= 1U << i;
+        if (p[n] == '\0')
+            return mask;
+        p += n + 1;
+    }
+}
+
+
+/*
+ * Build an alphabet of <alphacnt> symbols: the prefix of the digits,
+ * letters and "-_" (e.g., 16 is hex, 36 lowercase alphanumeric, 64
+ * base64url), then the other non-NUL bytes.
+ */
+static void
+bench_alphabet(unsigned char *alphabet, size_t alphacnt)
+{
+    static const char base[] =
+            "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_";
+    size_t n, c;
+
+    for (n = 0; n < alphacnt && base[n] != '\0'; ++n)
+        alphabet[n] = (unsigned char)base[n];
+    for (c = 1; n < alphacnt && c < 256; ++c) {
+        if (strchr(base, (int)c) == NULL)
+            alphabet[n++] = (unsigned char)c;
+    }
+}
+
+
+/*
+ * Select the random source <name> given to -s, reseeding "seeded" with
+ * its default seed 0.
+ */
+static void
+bench_source(const char *name)
+{
+    set_source(strcmp(name, "seeded") == 0 ? "seeded:0" : name);
+}
+
+
+/*
+ * Time one trial of <count> IDs, in ns/id.
+ */
+static double
+bench_trial(const struct speed_conf *conf, char *buf, size_t count)
+{
+    struct timespec tstart, tend;
+
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    speed_run(conf, buf, count);
+    clock_gettime(CLOCK_MONOTONIC, &tend);
+
+    return (double)timespec_diff(&tend, &tstart) / (double)count;
+}
 
-#include "nanoid.h"
-#include "nanoid_test.c"
 
+/*
+ * Warm up and time <ntrials> trials of <count> IDs.
+ */
+static void
+bench_measure(const struct speed_conf *conf, char *buf, size_t count,
+              size_t ntrials, struct bench_stat *st)
+{
+    double t[BENCH_MAX_LIST], prev, cur, med;
+    size_t i;
 
-static char *progname;
-static size_t speed_count = 1000000; /* iterations for speed test */
+    prev = bench_trial(conf, buf, count);
+    st->warmups = 1;
+    while (st->warmups < BENCH_MAX_WARMUPS) {
+        cur = bench_trial(conf, buf, count);
+        st->warmups++;
+        if (fabs(cur - prev) <= BENCH_STABLE * prev)
+            break;
+        prev = cur;
+    }
 
-static void usage(void);
+    for (i = 0; i < ntrials; ++i)
+        t[i] = bench_trial(conf, buf, count);
+    med = median(t, ntrials);
+    for (i = 0; i < ntrials; ++i)
+        t[i] = fabs(t[i] - med);
+    st->median = med;
+    st->mad = median(t, ntrials);
+}
 
 
-static size_t
-timespec_diff(struct timespec *tend, struct timespec *tstart)
+static int
+cmd_bench(int argc, char *argv[])
 {
-    long int t;
+    static const size_t def_lengths[] = {
+        8, 16, 21, 32, 64, 128, 256, 512, 1024,
+    };
+    static const size_t def_sizes[] = { 2, 10, 16, 36, 62, 64, 255 };
+    size_t lengths[BENCH_MAX_LIST], sizes[BENCH_MAX_LIST];
+    size_t nlengths, nsizes, ntrials, duration, li, ai, vi, count;
+    struct speed_conf conf;
+    struct bench_stat total, map;
+    struct nanoid_stats stats;
+    unsigned char alphabet[256];
+    const char *source, *srcarg;
+    char *buf, *endp;
+    double t, bytes;
+    unsigned int variants;
+    long cpu;
+    int opt, format, first;
 
-    t = (tend->tv_sec - tstart->tv_sec) * 1000000000L;
-    t += tend->tv_nsec;
-    t -= tstart->tv_nsec;
+    memset(&conf, 0, sizeof(conf));
+    conf.sampler = NANOID_SAMPLER_MASK;
+    nlengths = sizeof(def_lengths) / sizeof(def_lengths[0]);
+    memcpy(lengths, def_lengths, sizeof(def_lengths));
+    nsizes = sizeof(def_sizes) / sizeof(def_sizes[0]);
+    memcpy(sizes, def_sizes, sizeof(def_sizes));
+    variants = (1U << BENCH_NVARIANTS) - 1;
+    srcarg = "auto";
+    ntrials = 7;
+    duration = 10;
+    cpu = -1;
+    format = FORMAT_TEXT;
 
-    return (size_t)t;
+    while ((opt = getopt(argc, argv, "a:d:e:f:k:l:m:p:r:s:v:")) != -1) {
+        switch (opt) {
+        case 'a':
+            nsizes = parse_list(optarg, sizes, 2, 255, "alphabet sizes");
+            break;
+        case 'd':
+            duration = (size_t)strtoul(optarg, &endp, 10);
+            if (duration == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid duration: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'e':
+            set_engine(optarg);
+            break;
+        case 'f':
+            format = parse_format(optarg);
+            break;
+        case 'k':
+            set_kernel(optarg);
+            break;
+        case 'l':
+            nlengths = parse_list(optarg, lengths, 1, 65536, "lengths");
+            break;
+        case 'm':
+            conf.sampler = parse_sampler(optarg);
+            break;
+        case 'p':
+#ifndef HAVE_AFFINITY
+            fprintf(stderr, "ERROR: CPU pinning is not supported\n");
+            exit(1);
+#endif
+            cpu = strtol(optarg, &endp, 10);
+            if (cpu < 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid CPU: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            ntrials = (size_t)strtoul(optarg, &endp, 10);
+            if (ntrials == 0 || ntrials > BENCH_MAX_LIST || endp == optarg ||
+                *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid trials: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            set_source(optarg);
+            srcarg = optarg;
+            break;
+        case 'v':
+            variants = parse_variants(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc != optind)
+        usage();
+
+#ifdef HAVE_AFFINITY
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET((size_t)cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                   &cpus) != 0) {
+            fprintf(stderr, "ERROR: failed to pin to CPU %ld\n", cpu);
+            exit(1);
+        }
+    }
+#endif
+
+    source = nanoid_get_random_source();
+    switch (format) {
+    case FORMAT_TEXT:
+        printf("Source: %s\n", source);
+        printf("Kernel: %s\n", nanoid_get_kernel());
+        printf("Trials: %zu x %zu ms (median, MAD in ns/id)\n",
+               ntrials, duration);
+        printf("%-18s %6s %5s %10s %8s %10s %8s %10s %8s\n", "variant",
+               "length", "alpha", "ns/id", "mad", "map", "mad", "entropy",
+               "bytes");
+        break;
+    case FORMAT_CSV:
+        printf("variant,length,alphabet,source,kernel,engine,ids,warmups,"
+               "ns_median,ns_mad,map_median,map_mad,entropy_ns,"
+               "bytes_per_id\n");
+        break;
+    case FORMAT_JSON:
+        printf("{\"source\": \"%s\", \"kernel\": \"%s\", \"engine\": \"%s\", "
+               "\"cpu\": %ld, \"trials\": %zu, \"duration_ms\": %zu,\n"
+               " \"results\": [", source, nanoid_get_kernel(),
+               (nanoid_get_engine() == NANOID_ENGINE_CHACHA) ?
+               "chacha" : "system", cpu, ntrials, duration);
+        break;
+    }
+
+    first = 1;
+    for (vi = 0; vi < BENCH_NVARIANTS; ++vi) {
+        if (!(variants & (1U << vi)))
+            continue;
+        conf.use_ctx = bench_variants[vi].use_ctx;
+        conf.batch = bench_variants[vi].batch ? BENCH_BATCH : 0;
+
+        for (li = 0; li < nlengths; ++li) {
+            for (ai = 0; ai < nsizes; ++ai) {
+                /* The bits sampler only takes power-of-2 alphabets */
+                if (conf.use_ctx && conf.sampler == NANOID_SAMPLER_BITS &&
+                    (sizes[ai] & (sizes[ai] - 1)) != 0)
+                    continue;
+                bench_alphabet(alphabet, sizes[ai]);
+                conf.alphabet = alphabet;
+                conf.alphacnt = sizes[ai];
+                speed_setup(&conf, lengths[li]);
+                buf = speed_buffer(&conf);
+
+                /*
+                 * Start every cell from the source as selected (not the
+                 * one "auto" resolved to), and reseeded if seeded.
+                 */
+                bench_source(srcarg);
+
+                /* Calibrate the IDs per trial */
+                for (count = 64;; count *= 2) {
+                    t = bench_trial(&conf, buf, count);
+                    if (t * (double)count >= 1e6 * (double)duration ||
+                        count >= SIZE_MAX / 4)
+                        break;
+                }
+
+                nanoid_reset_stats();
+                bench_measure(&conf, buf, count, ntrials, &total);
+                nanoid_get_stats(&stats);
+                bytes = (double)stats.random_bytes / (double)count /
+                        (double)(total.warmups + ntrials);
+
+                nanoid_seed_random_source(1);
+                bench_measure(&conf, buf, count, ntrials, &map);
+
+                free(buf);
+                speed_teardown(&conf);
+
+                switch (format) {
+                case FORMAT_TEXT:
+                    printf("%-18s %6zu %5zu %10.2f %8.2f %10.2f %8.2f "
+                           "%10.2f %8.2f\n", bench_variants[vi].name,
+                           lengths[li], sizes[ai], total.median, total.mad,
+                           map.median, map.mad, total.median - map.median,
+                           bytes);
+                    break;
+                case FORMAT_CSV:
+                    printf("%s,%zu,%zu,%s,%s,%s,%zu,%zu,%.3f,%.3f,%.3f,"
+                           "%.3f,%.3f,%.3f\n", bench_variants[vi].name,
+                           lengths[li], sizes[ai], source,
+                           nanoid_get_kernel(),
+                           (nanoid_get_engine() == NANOID_ENGINE_CHACHA) ?
+                           "chacha" : "system", count, total.warmups,
+                           total.median, total.mad, map.median, map.mad,
+                           total.median - map.median, bytes);
+                    break;
+                case FORMAT_JSON:
+                    printf("%s\n  {\"variant\": \"%s\", \"length\": %zu, "
+                           "\"alphabet\": %zu, \"ids\": %zu, "
+                           "\"warmups\": %zu, \"ns_median\": %.3f, "
+                           "\"ns_mad\": %.3f, \"map_median\": %.3f, "
+                           "\"map_mad\": %.3f, \"entropy_ns\": %.3f, "
+                           "\"bytes_per_id\": %.3f}", first ? "" : ",",
+                           bench_variants[vi].name, lengths[li], sizes[ai],
+                           count, total.warmups, total.median, total.mad,
+                           map.median, map.mad, total.median - map.median,
+                           bytes);
+                    break;
+                }
+                first = 0;
+                fflush(stdout);
+            }
+        }
+    }
+    if (format == FORMAT_JSON)
+        printf("\n ]}\n");
+
+    return 0;
 }
 
 
 static int
-cmd_generate(int argc, char *argv[])
+cmd_test(int argc, char *argv[])
 {
+    struct nanoid_ctx *ctx = NULL;
+    struct sample *s;
     const char *alphabet;
-    char *buf, *endp;
-    size_t length;
-    int opt;
+    size_t count, i;
+    int opt, rc, sampler, use_ctx;
+    char buf[NANOID_SIZE];
 
+    count = speed_count;
     alphabet = NULL;
-    length = NANOID_SIZE;
+    sampler = NANOID_SAMPLER_MASK;
+    use_ctx = 0;
 
-    while ((opt = getopt(argc, argv, "a:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "a:e:k:m:s:")) != -1) {
         switch (opt) {
         case 'a':
             alphabet = optarg;
+            use_ctx = 1;
             break;
-        case 'l':
-            length = (size_t)strtoul(optarg, &endp, 10);
-            if (length == 0 || endp == optarg || *endp != '\0') {
-                fprintf(stderr, "ERROR: invalid length: %s\n", optarg);
-                exit(1);
-            }
+        case 'e':
+            set_engine(optarg);
+            break;
+        case 'k':
+            set_kernel(optarg);
+            break;
+        case 'm':
+            sampler = parse_sampler(optarg);
+            use_ctx = 1;
+            break;
+        case 's':
+            set_source(optarg);
             break;
         default:
             usage();
@@ -88,57 +2191,376 @@ cmd_generate(int argc, char *argv[])
     if (argc != optind)
         usage();
 
-    buf = malloc(length);
-    if (buf == NULL) {
-        fprintf(stderr, "ERROR: failed to allocate memory\n");
-        exit(1);
+    /* The public default path unless an alphabet or sampler is given */
+    if (use_ctx) {
+        ctx = new_ctx((const unsigned char *)alphabet,
+                      alphabet ? strlen(alphabet) : 0, sizeof(buf), sampler);
     }
 
-    if (nanoid_generate_r(buf, length, (const unsigned char *)alphabet,
-                          alphabet ? strlen(alphabet) : 0) == NULL) {
-        fprintf(stderr, "ERROR: failed to generate ID\n");
+    s = sample_new();
+    if (s == NULL) {
+        fprintf(stderr, "ERROR: failed to create sample\n");
         exit(1);
     }
 
-    printf("%.*s\n", (int)length, buf);
-    free(buf);
+    for (i = 0; i < count; ++i) {
+        if (ctx != NULL)
+            nanoid_ctx_generate(ctx, buf);
+        else
+            nanoid_generate_r(buf, sizeof(buf), NULL, 0);
+        sample_add(s, buf, sizeof(buf));
+    }
+
+    rc = sample_test(s);
+    rc |= test_pack(nanoid_get_kernel());
+    rc |= test_validate(nanoid_get_kernel());
+    rc |= test_map(nanoid_get_kernel());
+
+    sample_free(s);
+    nanoid_ctx_free(ctx);
+    return rc;
+}
+
+
+/*
+ * Collision test: the IDs are generated by several threads and turned into
+ * 64-bit keys (base-N values of their symbols, i.e., the packed IDs for a
+ * power-of-2 alphabet) inserted into a set; an insert finding its key
+ * already there is a collision.  The set is sized to the ID width:
+ * - up to 2^36 possible IDs, when it's smaller than the hash set, a bitmap
+ *   of one bit per possible key, set with an atomic OR;
+ * - else, a sharded open-addressing hash set of 32-bit slots: the top bits
+ *   of the hash of a key pick the shard, and the next 32 bits are stored
+ *   in the slot (0 is the empty slot; the value 0 is tracked aside).  Up
+ *   to 2^40 possible IDs, the hash is a bijection on 40 bits, so this is
+ *   exact; beyond, distinct keys sharing the top 40 bits of their 64-bit
+ *   hash also collide, which the expected count accounts for.
+ *
+ * Every shard is sized for a load factor of 3/4, and filled with atomic
+ * compare-and-swap, so the threads never lock.  The keys of a batch are
+ * hashed first and their slots prefetched some inserts ahead, to overlap
+ * the cache misses of the random inserts.
+ */
+#define COLLIDE_SHARD_BITS  8
+#define COLLIDE_SHARDS      (1U << COLLIDE_SHARD_BITS)
+#define COLLIDE_HASH_BITS   (COLLIDE_SHARD_BITS + 32) /* exact hashes */
+#define COLLIDE_BITMAP_BITS 36 /* at most 8 GiB */
+#define COLLIDE_BATCH       4096 /* IDs generated and inserted at a time */
+#define COLLIDE_PREFETCH    16 /* inserts ahead to prefetch */
+
+struct collide_shard {
+    uint32_t *slots;
+    uint32_t cap;
+    int zero; /* the value 0 was inserted */
+};
+
+struct collide_set {
+    struct collide_shard shards[COLLIDE_SHARDS];
+    uint64_t *bitmap; /* one bit per key, instead of the shards if set */
+    unsigned int hashbits; /* COLLIDE_HASH_BITS, or 64 if not exact */
+    const char *mode;
+    size_t bytes;
+};
+
+/* Collision test job of a thread */
+struct collide_job {
+    pthread_t thread;
+    struct collide_set *set;
+    const struct nanoid_ctx *ctx;
+    const unsigned char *alphabet; /* NULL for the default alphabet */
+    size_t alphacnt;
+    size_t length;
+    size_t packsize; /* packed ID size if a power-of-2 alphabet; else 0 */
+    const unsigned char *rev; /* symbol -> index; if packsize is 0 */
+    size_t count;
+    unsigned long long collisions;
+    int error;
+};
+
+
+/*
+ * Finalizer of MurmurHash3 on the low <bits> bits (a bijection of the keys
+ * below 2^bits): the keys of a broken generator may not be uniform, so mix
+ * them before picking the shard and slot.  Returns the hash in the top
+ * <bits> bits.
+ */
+static inline uint64_t
+collide_hash(uint64_t k, unsigned int bits)
+{
+    uint64_t mask = ~(uint64_t)0 >> (64 - bits);
+    unsigned int shift = bits / 2 + 1;
+
+    k ^= k >> shift;
+    k = (k * 0xff51afd7ed558ccdULL) & mask;
+    k ^= k >> shift;
+    k = (k * 0xc4ceb9fe1a85ec53ULL) & mask;
+    k ^= k >> shift;
+    return k << (64 - bits);
+}
+
+
+static inline uint32_t *
+collide_slot(const struct collide_set *set, uint64_t h,
+             const struct collide_shard **shard)
+{
+    const struct collide_shard *sh;
+    uint32_t v = (uint32_t)(h >> (32 - COLLIDE_SHARD_BITS));
+
+    sh = &set->shards[h >> (64 - COLLIDE_SHARD_BITS)];
+    *shard = sh;
+    return &sh->slots[((uint64_t)v * sh->cap) >> 32];
+}
+
+
+/* Returns the address where <key> with hash <h> goes, to prefetch it */
+static inline const void *
+collide_addr(const struct collide_set *set, uint64_t key, uint64_t h)
+{
+    const struct collide_shard *sh;
+
+    if (set->bitmap != NULL)
+        return &set->bitmap[key >> 6];
+    return collide_slot(set, h, &sh);
+}
+
+
+/*
+ * Set up <set> for <count> keys below <space>, as a bitmap if it's the
+ * smaller one, else as a hash set.
+ */
+static int
+collide_set_init(struct collide_set *set, size_t count, double space)
+{
+    size_t cap, words, i;
+
+    memset(set, 0, sizeof(*set));
+    cap = count / COLLIDE_SHARDS;
+    cap += cap / 3 + 64; /* load factor 3/4, with room for the variance */
+    if (cap > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (space <= (double)(1ULL << COLLIDE_BITMAP_BITS)) {
+        words = ((size_t)space + 63) / 64;
+        if (words * sizeof(uint64_t) <=
+            COLLIDE_SHARDS * cap * sizeof(uint32_t)) {
+            set->bitmap = calloc(words, sizeof(uint64_t));
+            if (set->bitmap == NULL)
+                return -1;
+            set->bytes = words * sizeof(uint64_t);
+            set->hashbits = 64; /* unused */
+            set->mode = "bitmap";
+            return 0;
+        }
+    }
+
+    if (space <= (double)(1ULL << COLLIDE_HASH_BITS)) {
+        set->hashbits = COLLIDE_HASH_BITS;
+        set->mode = "32-bit slots";
+    } else {
+        set->hashbits = 64;
+        set->mode = "32-bit slots, 40-bit hashes";
+    }
+    for (i = 0; i < COLLIDE_SHARDS; ++i) {
+        set->shards[i].cap = (uint32_t)cap;
+        set->shards[i].slots = calloc(cap, sizeof(uint32_t));
+        if (set->shards[i].slots == NULL)
+            return -1;
+        set->bytes += cap * sizeof(uint32_t);
+    }
 
     return 0;
 }
 
 
+static void
+collide_set_free(struct collide_set *set)
+{
+    size_t i;
+
+    free(set->bitmap);
+    for (i = 0; i < COLLIDE_SHARDS; ++i)
+        free(set->shards[i].slots);
+}
+
+
+/*
+ * Insert <key> with hash <h>.
+ * Returns 0 if inserted, 1 if already there, or -1 if the shard is full.
+ */
 static int
-cmd_speed(int argc, char *argv[])
+collide_insert(struct collide_set *set, uint64_t key, uint64_t h)
+{
+    struct collide_shard *sh;
+    uint32_t *slot, *end, v, x;
+    uint64_t bit;
+    uint32_t n;
+
+    if (set->bitmap != NULL) {
+        bit = (uint64_t)1 << (key & 63);
+        return (__atomic_fetch_or(&set->bitmap[key >> 6], bit,
+                                  __ATOMIC_RELAXED) & bit) != 0;
+    }
+
+    sh = &set->shards[h >> (64 - COLLIDE_SHARD_BITS)];
+    x = (uint32_t)(h >> (32 - COLLIDE_SHARD_BITS));
+    if (x == 0)
+        return __atomic_exchange_n(&sh->zero, 1, __ATOMIC_RELAXED);
+
+    slot = &sh->slots[((uint64_t)x * sh->cap) >> 32];
+    end = sh->slots + sh->cap;
+    for (n = 0; n < sh->cap; ++n) {
+        v = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        if (v == 0 && __atomic_compare_exchange_n(slot, &v, x, 0,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED))
+            return 0;
+        /* Also the value just stored by another thread */
+        if (v == x)
+            return 1;
+        if (++slot == end)
+            slot = sh->slots;
+    }
+
+    return -1;
+}
+
+
+static void *
+collide_thread(void *arg)
+{
+    struct collide_job *job = arg;
+    unsigned char *ids, *packed;
+    uint64_t *keys, *hashes, k;
+    size_t done, n, i, j, len = job->length;
+    unsigned int shift;
+    int ret;
+
+    ids = malloc(COLLIDE_BATCH * len);
+    packed = malloc(COLLIDE_BATCH * (job->packsize ? job->packsize : 1));
+    keys = malloc(COLLIDE_BATCH * sizeof(*keys));
+    hashes = malloc(COLLIDE_BATCH * sizeof(*hashes));
+    if (ids == NULL || packed == NULL || keys == NULL || hashes == NULL) {
+        job->error = 1;
+        goto out;
+    }
+    /* Drop the pad bits of the packed IDs */
+    shift = 0;
+    if (job->packsize > 0) {
+        shift = (unsigned int)(job->packsize * 8 -
+                               len * (size_t)__builtin_ctzl(job->alphacnt));
+    }
+
+    for (done = 0; done < job->count; done += n) {
+        n = job->count - done;
+        if (n > COLLIDE_BATCH)
+            n = COLLIDE_BATCH;
+        if (nanoid_ctx_generate_batch(job->ctx, ids, n, 0, 0) == NULL) {
+            job->error = 1;
+            goto out;
+        }
+
+        if (job->packsize > 0) {
+            if (nanoid_pack_batch(packed, ids, n, len, 0, job->alphabet,
+                                  job->alphacnt) == NULL) {
+                job->error = 1;
+                goto out;
+            }
+            for (i = 0; i < n; ++i) {
+                for (j = 0, k = 0; j < job->packsize; ++j)
+                    k = (k << 8) | packed[i * job->packsize + j];
+                keys[i] = k >> shift;
+            }
+        } else {
+            for (i = 0; i < n; ++i) {
+                for (j = 0, k = 0; j < len; ++j)
+                    k = k * job->alphacnt + job->rev[ids[i * len + j]];
+                keys[i] = k;
+            }
+        }
+
+        for (i = 0; i < n; ++i)
+            hashes[i] = collide_hash(keys[i], job->set->hashbits);
+        for (i = 0; i < n; ++i) {
+            if (i + COLLIDE_PREFETCH < n) {
+                __builtin_prefetch(collide_addr(job->set,
+                                                keys[i + COLLIDE_PREFETCH],
+                                                hashes[i + COLLIDE_PREFETCH]),
+                                   1);
+            }
+            ret = collide_insert(job->set, keys[i], hashes[i]);
+            if (ret == -1) {
+                job->error = 1;
+                goto out;
+            }
+            job->collisions += (unsigned long long)ret;
+        }
+    }
+
+out:
+    free(hashes);
+    free(keys);
+    free(packed);
+    free(ids);
+    return NULL;
+}
+
+
+static int
+cmd_collide(int argc, char *argv[])
 {
     struct timespec tstart, tend;
-    size_t count, burnin, length, i, t;
-    char *buf, *endp;
-    int opt;
+    struct collide_set *set;
+    struct collide_job *jobs;
+    struct nanoid_ctx *ctx;
+    const unsigned char *alphabet;
+    unsigned char rev[256];
+    unsigned long long collisions;
+    size_t alphacnt, length, count, nthreads, packsize, i;
+    double space, expect, pany, z, secs;
+    char *endp;
+    int opt, error;
 
-    length = NANOID_SIZE;
-    count = speed_count;
-    burnin = 0;
+    alphabet = NULL;
+    alphacnt = 64;
+    length = 6;
+    count = 10000000;
+    nthreads = 1;
 
-    while ((opt = getopt(argc, argv, "b:c:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "a:e:k:l:n:s:t:")) != -1) {
         switch (opt) {
-        case 'b':
-            burnin = (size_t)strtoul(optarg, &endp, 10);
-            if (burnin == 0 || endp == optarg || *endp != '\0') {
-                fprintf(stderr, "ERROR: invalid burnin: %s\n", optarg);
+        case 'a':
+            alphabet = (const unsigned char *)optarg;
+            alphacnt = strlen(optarg);
+            break;
+        case 'e':
+            set_engine(optarg);
+            break;
+        case 'k':
+            set_kernel(optarg);
+            break;
+        case 'l':
+            length = (size_t)strtoul(optarg, &endp, 10);
+            if (length == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid length: %s\n", optarg);
                 exit(1);
             }
             break;
-        case 'c':
+        case 'n':
             count = (size_t)strtoul(optarg, &endp, 10);
             if (count == 0 || endp == optarg || *endp != '\0') {
                 fprintf(stderr, "ERROR: invalid count: %s\n", optarg);
                 exit(1);
             }
             break;
-        case 'l':
-            length = (size_t)strtoul(optarg, &endp, 10);
-            if (length == 0 || endp == optarg || *endp != '\0') {
-                fprintf(stderr, "ERROR: invalid length: %s\n", optarg);
+        case 's':
+            set_source(optarg);
+            break;
+        case 't':
+            nthreads = (size_t)strtoul(optarg, &endp, 10);
+            if (nthreads == 0 || endp == optarg || *endp != '\0') {
+                fprintf(stderr, "ERROR: invalid threads: %s\n", optarg);
                 exit(1);
             }
             break;
@@ -149,66 +2571,98 @@ cmd_speed(int argc, char *argv[])
     if (argc != optind)
         usage();
 
-    if (burnin == 0)
-        burnin = count / 10;
+    ctx = new_ctx(alphabet, alphacnt, length, NANOID_SAMPLER_MASK);
 
-    buf = malloc(length);
-    if (buf == NULL) {
-        fprintf(stderr, "ERROR: failed to allocate memory\n");
+    /* The keys must fit 64 bits: N^len <= 2^64 */
+    space = pow((double)alphacnt, (double)length);
+    if (space > 18446744073709551616.0) {
+        fprintf(stderr, "ERROR: IDs of more than 64 bits "
+                "(expected collisions would be ~0)\n");
         exit(1);
     }
+    packsize = nanoid_packed_size(length, alphabet, alphacnt);
+    if (packsize == 0) {
+        memset(rev, 0, sizeof(rev));
+        for (i = 0; i < alphacnt; ++i)
+            rev[alphabet[i]] = (unsigned char)i;
+    }
 
-    printf("Burning in ... (n=%zu)\n", burnin);
-    for (i = 1; i < burnin; ++i) {
-        nanoid_generate_r(buf, length, NULL, 0);
-        (void)buf;
+    set = malloc(sizeof(*set));
+    jobs = calloc(nthreads, sizeof(*jobs));
+    if (set == NULL || jobs == NULL || collide_set_init(set, count, space) == -1) {
+        fprintf(stderr, "ERROR: failed to allocate the hash set\n");
+        exit(1);
     }
 
-    printf("Running speed test ... (n=%zu)\n", count);
+    printf("Collide: %zu IDs of length %zu, alphabet size %zu "
+           "(%.1f bits), %zu threads\n",
+           count, length, alphacnt, log2(space), nthreads);
+    printf("Memory: %.1f MiB (%.2f bytes/id, %s)\n",
+           (double)set->bytes / 1048576.0,
+           (double)set->bytes / (double)count, set->mode);
+
     clock_gettime(CLOCK_MONOTONIC, &tstart);
-    for (i = 1; i < count; ++i) {
-        nanoid_generate_r(buf, length, NULL, 0);
-        (void)buf;
+    for (i = 0; i < nthreads; ++i) {
+        jobs[i].set = set;
+        jobs[i].ctx = ctx;
+        jobs[i].alphabet = alphabet;
+        jobs[i].alphacnt = alphacnt;
+        jobs[i].length = length;
+        jobs[i].packsize = packsize;
+        jobs[i].rev = rev;
+        jobs[i].count = count / nthreads + (i < count % nthreads);
+        if (pthread_create(&jobs[i].thread, NULL, collide_thread,
+                           &jobs[i]) != 0) {
+            fprintf(stderr, "ERROR: failed to create thread\n");
+            exit(1);
+        }
+    }
+    collisions = 0;
+    error = 0;
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(jobs[i].thread, NULL);
+        collisions += jobs[i].collisions;
+        error |= jobs[i].error;
     }
     clock_gettime(CLOCK_MONOTONIC, &tend);
-
-    t = timespec_diff(&tend, &tstart);
-    printf("Speed: %zu ns/id, %zu id/s\n", t / count, 1000000000UL * count / t);
-
-    free(buf);
-    return 0;
-}
-
-
-static int
-cmd_test(int argc, char *argv[])
-{
-    struct sample *s;
-    size_t count, i;
-    int rc;
-    char buf[NANOID_SIZE];
-
-    count = speed_count;
-
-    (void)argv;
-    if (argc != optind)
-        usage();
-
-    s = sample_new();
-    if (s == NULL) {
-        fprintf(stderr, "ERROR: failed to create sample\n");
+    if (error) {
+        fprintf(stderr, "ERROR: failed to generate or insert IDs\n");
         exit(1);
     }
 
-    for (i = 0; i < count; ++i) {
-        nanoid_generate_r(buf, sizeof(buf), NULL, 0);
-        sample_add(s, buf, sizeof(buf));
+    secs = (double)timespec_diff(&tend, &tstart) / 1e9;
+    printf("Time: %.3f s, %.2f M id/s\n", secs, (double)count / secs / 1e6);
+
+    /*
+     * Birthday bound: of <n> IDs drawn from <d> values, the expected
+     * number of repeats is n - d * (1 - (1 - 1/d)^n), about n^2 / (2d);
+     * the count is nearly Poisson, i.e., its variance is the expectation.
+     */
+    if (set->hashbits > COLLIDE_HASH_BITS && set->bitmap == NULL) {
+        /* Distinct keys also collide on the top 40 bits of their hash */
+        space = 1 / (1 / space + 1 / (double)(1ULL << COLLIDE_HASH_BITS));
     }
+    expect = (double)count + space * expm1((double)count *
+                                           log1p(-1.0 / space));
+    if (expect < 0)
+        expect = 0;
+    pany = -expm1(-(double)count * ((double)count - 1) / (2 * space));
+    printf("Collisions: %llu, expected %.3f (birthday bound), "
+           "P(any)=%.4f\n", collisions, expect, pany);
 
-    rc = sample_test(s);
+    collide_set_free(set);
+    free(set);
+    free(jobs);
+    nanoid_ctx_free(ctx);
 
-    sample_free(s);
-    return rc;
+    z = ((double)collisions - expect) / sqrt(expect > 1 ? expect : 1);
+    if (fabs(z) < 4) {
+        printf("Collisions match the birthday bound (z=%.2f).\n", z);
+        return 0;
+    } else {
+        printf("Collisions do NOT match the birthday bound (z=%.2f)!\n", z);
+        return 1;
+    }
 }
 
 
@@ -219,20 +2673,86 @@ usage(void)
             "Nano ID command utility.\n"
             "\n"
             "Generate ID:\n"
-            ">>> %s [-a alphabet] [-l length]\n"
+            ">>> %s [-0] [-T] [-a alphabet] [-f format] [-l length]\n"
+            "        [-n count] [-o file] [-t threads]\n"
+            "    -0: separate the IDs with NUL instead of newline\n"
+            "    -T: generate a sortable (time-prefixed) ID\n"
             "    -a: specify the custom alphabet\n"
+            "    -f: specify the format of -o (text, packed)\n"
             "    -l: specify the custom ID length\n"
+            "    -n: stream the given number of IDs (in any order)\n"
+            "    -o: write the IDs into a file of fixed-size records\n"
+            "    -t: specify the threads of -n (default: online CPUs)\n"
             "\n"
             "Speed test:\n"
-            ">>> %s speed [-b burnin] [-c count] [-l length]\n"
+            ">>> %s speed [-B batch] [-C] [-H] [-I] [-K] [-L] [-P size] [-T]\n"
+            "        [-a alphabet] [-b burnin] [-c count] [-e engine]\n"
+            "        [-f format] [-g group] [-k kernel] [-l length]\n"
+            "        [-m sampler] [-p] [-s source] [-t threads]\n"
+            "    -B: generate IDs in batches of the given size\n"
+            "    -C: generate IDs with a precompiled alphabet context\n"
+            "    -H: time every call (or group of -g calls) and report the\n"
+            "        latency percentiles\n"
+            "    -I: simulate B+tree inserts of the generated IDs\n"
+            "    -K: pack and unpack the generated IDs (power-of-2 alphabet)\n"
+            "    -L: run over the ID lengths 8..4096\n"
+            "    -P: take IDs from a pool of the given size; implies -C\n"
+            "    -T: generate sortable (time-prefixed) IDs\n"
+            "    -a: specify the custom alphabet\n"
             "    -b: specify the burn-in iterations (default: count/10)\n"
             "    -c: specify the test iterations (default: %zu)\n"
+            "    -e: specify the random engine (system, chacha)\n"
+            "    -f: specify the latency report format (text, csv, json)\n"
+            "    -g: specify the calls per latency sample (default: 1)\n"
+            "    -k: force the mapping kernel (scalar, ssse3, avx2, avx512)\n"
             "    -l: specify the custom ID length\n"
+            "    -m: specify the sampler (mask, digits, bits); implies -C\n"
+            "    -p: pin the threads of -t to CPUs 0, 1, ...\n"
+            "    -s: specify the random source (auto, vdso, getentropy,\n"
+            "        getrandom, arc4random, urandom, seeded[:seed])\n"
+            "    -t: run with 1..threads threads (count IDs each) and\n"
+            "        report the scaling\n"
+            "\n"
+            "Benchmark matrix:\n"
+            ">>> %s bench [-a sizes] [-d duration] [-e engine] [-f format]\n"
+            "        [-k kernel] [-l lengths] [-m sampler] [-p cpu] [-r trials]\n"
+            "        [-s source] [-v variants]\n"
+            "    -a: specify the alphabet sizes (default: 2,10,16,36,62,64,255)\n"
+            "    -d: specify the duration of a trial in ms (default: 10)\n"
+            "    -e: specify the random engine (system, chacha)\n"
+            "    -f: specify the report format (text, csv, json)\n"
+            "    -k: force the mapping kernel (scalar, ssse3, avx2, avx512)\n"
+            "    -l: specify the ID lengths (default: 8,16,21,32,...,1024)\n"
+            "    -m: specify the sampler of the ctx variants (mask, digits,\n"
+            "        bits)\n"
+            "    -p: pin to the given CPU\n"
+            "    -r: specify the trials (default: 7)\n"
+            "    -s: specify the random source (see above)\n"
+            "    -v: specify the API variants (default: generate_r,\n"
+            "        generate_batch,ctx_generate,ctx_generate_batch)\n"
             "\n"
             "Distribution uniformity test:\n"
-            ">>> %s test\n"
+            ">>> %s test [-a alphabet] [-e engine] [-k kernel] [-m sampler]\n"
+            "        [-s source]\n"
+            "    -a: specify the custom alphabet\n"
+            "    -e: specify the random engine (system, chacha)\n"
+            "    -k: force the mapping kernel (scalar, ssse3, avx2, avx512)\n"
+            "    -m: specify the sampler (mask, digits, bits)\n"
+            "    -s: specify the random source (see above)\n"
             "\n"
-            , progname, progname, speed_count, progname);
+            "Collision test:\n"
+            ">>> %s collide [-a alphabet] [-e engine] [-k kernel] [-l length]\n"
+            "        [-n count] [-s source] [-t threads]\n"
+            "    -a: specify the custom alphabet\n"
+            "    -e: specify the random engine (system, chacha)\n"
+            "    -k: force the mapping kernel (scalar, ssse3, avx2, avx512)\n"
+            "    -l: specify the ID length (default: 6); at most 64 bits\n"
+            "    -n: specify the number of IDs (default: 10000000)\n"
+            "    -s: specify the random source (see above)\n"
+            "    -t: specify the number of threads (default: 1)\n"
+            "\n"
+            , progname, progname, speed_count, progname, progname,
+            progname);
     exit(1);
 }
 
@@ -254,9 +2774,15 @@ main(int argc, char *argv[])
     } else if (strcmp(cmd, "speed") == 0) {
         optind++;
         return cmd_speed(argc, argv);
+    } else if (strcmp(cmd, "bench") == 0) {
+        optind++;
+        return cmd_bench(argc, argv);
     } else if (strcmp(cmd, "test") == 0) {
         optind++;
         return cmd_test(argc, argv);
+    } else if (strcmp(cmd, "collide") == 0) {
+        optind++;
+        return cmd_collide(argc, argv);
     } else {
         return cmd_generate(argc, argv);
     }
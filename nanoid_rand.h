@@ -29,11 +29,17 @@
 #undef HAVE_GETENTROPY
 #undef HAVE_GETRANDOM
 #undef HAVE_ARC4RANDOM_BUF
+#undef HAVE_URANDOM
+#undef HAVE_VDSO_GETRANDOM
 
 /*
  * Credit: https://sourceforge.net/p/predef/wiki/OperatingSystems/
+ *
+ * Define NANOID_FORCE_URANDOM to skip the detection and always read
+ * from [/dev/urandom], e.g. to benchmark it against getentropy().
  */
-#if defined(__DragonFly__)
+#if defined(NANOID_FORCE_URANDOM)
+#elif defined(__DragonFly__)
 #  include <sys/param.h>
 #  if __DragonFly_version >= 600200
 #    define HAVE_GETENTROPY
@@ -71,35 +77,268 @@
 #    define HAVE_ARC4RANDOM_BUF
 #  endif
 #elif defined(__linux__)
+#  define HAVE_VDSO_GETRANDOM /* detected at run time */
 #  if defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ >= 25
 #    define HAVE_GETENTROPY
+#    define HAVE_GETRANDOM
 #  endif
 #else
 #  warning "Unsupported operation system! Fallback to [/dev/urandom]."
 #endif
 
+/*
+ * Maximum number of bytes requested from the random source at once:
+ * getentropy() fails beyond 256 bytes, and getrandom() never returns
+ * short up to 256 bytes.
+ */
+#if defined(HAVE_GETENTROPY) || defined(HAVE_GETRANDOM)
+#define RANDOMBYTES_MAX 256
+#else
+#define RANDOMBYTES_MAX 65536
+#endif
+
 #if defined(HAVE_GETENTROPY)
 #  if defined(__APPLE__)
 #    include <sys/random.h> /* macOS is so weird ... */
 #  else
 #    include <unistd.h>
 #  endif
-#elif defined(HAVE_GETRANDOM)
+#endif
+#if defined(HAVE_GETRANDOM)
 #include <sys/random.h>
-#elif defined(HAVE_ARC4RANDOM_BUF)
+#endif
+#if defined(HAVE_ARC4RANDOM_BUF)
 #include <stdlib.h>
-#else
+#endif
+
+/* [/dev/urandom] is always available, as fallback or on request. */
 #include <errno.h>
 #include <fcntl.h> /* open() */
+#include <pthread.h>
+#include <string.h> /* memcpy() */
 #include <unistd.h> /* read(), close() */
+#define HAVE_URANDOM
+
+#if defined(HAVE_VDSO_GETRANDOM)
+#include "nanoid_vdso.h"
+#endif
+
+/*
+ * Name of the random source selected at compile time.
+ */
+#if defined(HAVE_GETENTROPY)
+#define RANDOMBYTES_SOURCE "getentropy"
+#elif defined(HAVE_GETRANDOM)
+#define RANDOMBYTES_SOURCE "getrandom"
+#elif defined(HAVE_ARC4RANDOM_BUF)
+#define RANDOMBYTES_SOURCE "arc4random"
+#else
+#define RANDOMBYTES_SOURCE "urandom"
+#endif
+
+
+#if defined(HAVE_URANDOM)
+/*
+ * [/dev/urandom] is opened once, on first use, and the descriptor is
+ * kept for the lifetime of the process. Requests smaller than the
+ * buffer are served from a per-thread buffer filled by one read().
+ */
+#define URANDOM_BUFSZ 4096
+
+struct urandom_buf {
+    size_t have;
+    unsigned char buf[URANDOM_BUFSZ];
+};
+
+static int urandom_fd = -1;
+static int urandom_atfork;
+static pthread_mutex_t urandom_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct urandom_buf urandom_tls;
+
+static void
+urandom_prepare(void)
+{
+    pthread_mutex_lock(&urandom_lock);
+}
+
+static void
+urandom_parent(void)
+{
+    pthread_mutex_unlock(&urandom_lock);
+}
+
+/*
+ * Only the forking thread survives in the child: wipe its buffer so
+ * that parent and child never hand out the same bytes, and reopen the
+ * descriptor lazily in case the child closes or reuses it.
+ */
+static void
+urandom_child(void)
+{
+    if (urandom_fd >= 0)
+        close(urandom_fd);
+    urandom_fd = -1;
+    memset(&urandom_tls, 0, sizeof(urandom_tls));
+    pthread_mutex_unlock(&urandom_lock);
+}
+
+static int
+urandom_open(void)
+{
+    int fd = __atomic_load_n(&urandom_fd, __ATOMIC_ACQUIRE);
+
+    if (fd >= 0)
+        return fd;
+
+    pthread_mutex_lock(&urandom_lock);
+    fd = urandom_fd;
+    if (fd < 0 && !urandom_atfork) {
+        if (pthread_atfork(urandom_prepare, urandom_parent,
+                           urandom_child) != 0) {
+            pthread_mutex_unlock(&urandom_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        urandom_atfork = 1;
+    }
+    if (fd < 0) {
+#if defined(O_CLOEXEC)
+        do
+            fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        while (fd < 0 && errno == EINTR);
+#else
+        do
+            fd = open("/dev/urandom", O_RDONLY);
+        while (fd < 0 && errno == EINTR);
+        if (fd >= 0)
+            (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+        if (fd >= 0)
+            __atomic_store_n(&urandom_fd, fd, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&urandom_lock);
+
+    return fd;
+}
+
+/*
+ * Read exactly $n bytes, retrying on EINTR and short reads.
+ */
+static int
+urandom_read(int fd, unsigned char *buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t r = read(fd, buf, n);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buf += r;
+        n -= (size_t)r;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy up to $n buffered bytes to $buf and wipe them from the buffer.
+ */
+static inline size_t
+urandom_take(struct urandom_buf *ub, unsigned char *buf, size_t n)
+{
+    unsigned char *p;
+
+    if (n > ub->have)
+        n = ub->have;
+    p = ub->buf + URANDOM_BUFSZ - ub->have;
+    memcpy(buf, p, n);
+    memset(p, 0, n);
+    ub->have -= n;
+
+    return n;
+}
+
+static inline int
+urandom_randombytes(void *buf, size_t n)
+{
+    struct urandom_buf *ub = &urandom_tls;
+    unsigned char *p = (unsigned char *)buf;
+    size_t k;
+    int fd;
+
+    k = urandom_take(ub, p, n);
+    p += k;
+    n -= k;
+    if (n == 0)
+        return 0;
+
+    if ((fd = urandom_open()) < 0)
+        return -1;
+    if (n >= URANDOM_BUFSZ)
+        return urandom_read(fd, p, n);
+
+    if (urandom_read(fd, ub->buf, URANDOM_BUFSZ) != 0)
+        return -1;
+    ub->have = URANDOM_BUFSZ;
+    (void)urandom_take(ub, p, n);
+
+    return 0;
+}
 #endif
 
 
+#if defined(HAVE_GETRANDOM)
+/*
+ * Fill $buf of size $n with getrandom(), which may return short for
+ * requests beyond 256 bytes or when interrupted by a signal.
+ */
+static inline int
+getrandom_randombytes(void *buf, size_t n)
+{
+    unsigned char *p = (unsigned char *)buf;
+    ssize_t r;
+
+    while (n > 0) {
+        r = getrandom(p, n, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        n -= (size_t)r;
+    }
+
+    return 0;
+}
+#endif
+
+
+/*
+ * Return the name of the random source used by generate_randombytes().
+ */
+static inline const char *
+randombytes_source(void)
+{
+#if defined(HAVE_VDSO_GETRANDOM)
+    if (vdso_getrandom_available())
+        return "vdso";
+#endif
+    return RANDOMBYTES_SOURCE;
+}
+
+
 /*
  * Generate crypto-secure pseudorandom data to fill the buffer $buf
  * of size $n.
  *
  * Try to obtain random data from the following sources:
+ * - vDSO getrandom() (Linux, if the running kernel provides it)
  * - getentropy()
  * - getrandom()
  * - arc4random_buf()
@@ -112,37 +351,20 @@ generate_randombytes(void *buf, size_t n)
 {
     int ret;
 
+#if defined(HAVE_VDSO_GETRANDOM)
+    if (vdso_getrandom_available() && vdso_getrandom(buf, n) == 0)
+        return 0;
+#endif
+
 #if defined(HAVE_GETENTROPY)
     ret = getentropy(buf, n);
 #elif defined(HAVE_GETRANDOM)
-    ret = (int)getrandom(buf, n, 0);
+    ret = getrandom_randombytes(buf, n);
 #elif defined(HAVE_ARC4RANDOM_BUF)
     arc4random_buf(buf, n);
     ret = 0;
 #else
-    int fd = open("/dev/urandom", O_RDONLY);
-    if (fd == -1) {
-        ret = -1;
-        goto out;
-    }
-
-    size_t o = 0;
-    while (o < n) {
-        ssize_t r = read(fd, (unsigned char *)buf + o, n - o);
-        if (r < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
-                continue;
-            ret = -1;
-            goto out;
-        }
-        o += (size_t)r;
-    }
-
-    ret = 0;
-
-out:
-    if (fd >= 0)
-        close(fd);
+    ret = urandom_randombytes(buf, n);
 #endif
 
     return ret;
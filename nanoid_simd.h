@@ -0,0 +1,779 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * SIMD kernels mapping random bytes to alphabet symbols.
+ *
+ * Every kernel consumes the random bytes in whole vectors: the bytes are
+ * masked, looked up in the (padded) alphabet with shuffles, and, for an
+ * alphabet whose size isn't a power of 2, the rejected bytes are dropped
+ * by compressing the vector.  The caller finishes the remaining bytes with
+ * the scalar code.
+ *
+ * The kernels are compiled with function-level target attributes and
+ * selected at runtime according to the CPU features.
+ *
+ * Also the validation kernels of the default (base64url) alphabet, which
+ * check every byte with signed range compares, and the packing kernels of
+ * 64-symbol alphabets, which convert between 4 symbols and 3 bytes as the
+ * base64 codecs do.
+ */
+
+#ifndef NANOID_SIMD_H_
+#define NANOID_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#undef HAVE_SIMD_X86
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define HAVE_SIMD_X86
+#endif
+
+#ifdef HAVE_SIMD_X86
+
+#include <immintrin.h>
+
+/*
+ * Shuffle patterns to compress the accepted bytes (bits set in the index)
+ * of an 8-byte group to the front; unused lanes are 0x80 (zeroed).
+ */
+static uint64_t simd_compress_lut[256];
+
+
+static void
+simd_init(void)
+{
+    uint64_t v;
+    unsigned int m, b, n;
+
+    for (m = 0; m < 256; ++m) {
+        v = 0;
+        for (b = 0, n = 0; b < 8; ++b) {
+            if (m & (1U << b))
+                v |= (uint64_t)b << (8 * n++);
+        }
+        for (; n < 8; ++n)
+            v |= (uint64_t)0x80 << (8 * n);
+        simd_compress_lut[m] = v;
+    }
+
+    __builtin_cpu_init();
+}
+
+
+static int
+simd_have_ssse3(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+
+static int
+simd_have_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+
+static int
+simd_have_avx512(void)
+{
+    return __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("bmi2") &&
+           __builtin_cpu_supports("avx512vbmi") &&
+           __builtin_cpu_supports("avx512vbmi2");
+}
+
+
+/*
+ * Look up the masked bytes <x> (all < 64) in the 4 16-byte tables <t>.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+simd_lookup64_128(const __m128i t[4], __m128i x, int ntbl)
+{
+    __m128i lo, hi, r;
+    int k;
+
+    lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+    if (ntbl == 1)
+        return _mm_shuffle_epi8(t[0], lo);
+
+    hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x0f));
+    r = _mm_setzero_si128();
+    for (k = 0; k < ntbl; ++k) {
+        r = _mm_or_si128(r, _mm_and_si128(
+                _mm_shuffle_epi8(t[k], lo),
+                _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)k))));
+    }
+
+    return r;
+}
+
+
+/*
+ * Store the accepted bytes (bits set in <m>) of <v> to <dst>, writing
+ * 16 bytes at most.  Returns the number of bytes accepted.
+ */
+__attribute__((target("ssse3")))
+static inline size_t
+simd_compress_128(unsigned char *dst, __m128i v, unsigned int m)
+{
+    __m128i s;
+    size_t n;
+
+    s = _mm_loadl_epi64((const __m128i *)(const void *)
+                        &simd_compress_lut[m & 0xff]);
+    _mm_storel_epi64((__m128i *)(void *)dst, _mm_shuffle_epi8(v, s));
+    n = (size_t)__builtin_popcount(m & 0xff);
+
+    s = _mm_loadl_epi64((const __m128i *)(const void *)
+                        &simd_compress_lut[(m >> 8) & 0xff]);
+    _mm_storel_epi64((__m128i *)(void *)(dst + n),
+                     _mm_shuffle_epi8(_mm_srli_si128(v, 8), s));
+    n += (size_t)__builtin_popcount((m >> 8) & 0xff);
+
+    return n;
+}
+
+
+/*
+ * Map the random bytes <src> of length <srclen> to at most <dstlen>
+ * symbols of the <alphabet> (padded to 256 bytes) of size <alphacnt>.
+ * Only alphabets with a mask of at most 63 are supported.
+ * Returns the number of symbols stored, and sets <*used> to the number of
+ * random bytes consumed.
+ */
+__attribute__((target("ssse3")))
+static size_t
+simd_map_ssse3(const unsigned char *alphabet, size_t alphacnt,
+               uint32_t mask, unsigned char *dst, size_t dstlen,
+               const unsigned char *src, size_t srclen, size_t *used)
+{
+    __m128i t[4], vmask, vlimit, x, sym;
+    size_t i, j;
+    unsigned int m;
+    int k, ntbl, pow2;
+
+    ntbl = (int)((mask >> 4) + 1);
+    for (k = 0; k < ntbl; ++k)
+        t[k] = _mm_loadu_si128((const __m128i *)(const void *)
+                               (alphabet + 16 * k));
+    vmask = _mm_set1_epi8((char)mask);
+    vlimit = _mm_set1_epi8((char)alphacnt);
+    pow2 = (alphacnt == mask + 1);
+
+    for (i = 0, j = 0; srclen - i >= 16 && dstlen - j >= 16; i += 16) {
+        x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(const void *)
+                                          (src + i)), vmask);
+        sym = simd_lookup64_128(t, x, ntbl);
+        if (pow2) {
+            _mm_storeu_si128((__m128i *)(void *)(dst + j), sym);
+            j += 16;
+            continue;
+        }
+
+        m = (unsigned int)_mm_movemask_epi8(_mm_cmplt_epi8(x, vlimit));
+        if (m == 0xffff) {
+            _mm_storeu_si128((__m128i *)(void *)(dst + j), sym);
+            j += 16;
+        } else {
+            j += simd_compress_128(dst + j, sym, m);
+        }
+    }
+
+    *used = i;
+    return j;
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+simd_map_avx2(const unsigned char *alphabet, size_t alphacnt,
+              uint32_t mask, unsigned char *dst, size_t dstlen,
+              const unsigned char *src, size_t srclen, size_t *used)
+{
+    __m256i t[4], vmask, vlimit, lo, hi, x, sym;
+    size_t i, j, u;
+    unsigned int m;
+    int k, ntbl, pow2;
+
+    ntbl = (int)((mask >> 4) + 1);
+    for (k = 0; k < ntbl; ++k)
+        t[k] = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)(const void *)
+                                (alphabet + 16 * k)));
+    vmask = _mm256_set1_epi8((char)mask);
+    vlimit = _mm256_set1_epi8((char)alphacnt);
+    pow2 = (alphacnt == mask + 1);
+
+    for (i = 0, j = 0; srclen - i >= 32 && dstlen - j >= 32; i += 32) {
+        x = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)
+                                                (const void *)(src + i)),
+                             vmask);
+        lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+        hi = _mm256_and_si256(_mm256_srli_epi16(x, 4),
+                              _mm256_set1_epi8(0x0f));
+        sym = _mm256_shuffle_epi8(t[0], lo);
+        if (ntbl > 1) {
+            sym = _mm256_and_si256(sym, _mm256_cmpeq_epi8(
+                    hi, _mm256_setzero_si256()));
+            for (k = 1; k < ntbl; ++k) {
+                sym = _mm256_or_si256(sym, _mm256_and_si256(
+                        _mm256_shuffle_epi8(t[k], lo),
+                        _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)k))));
+            }
+        }
+
+        if (pow2) {
+            _mm256_storeu_si256((__m256i *)(void *)(dst + j), sym);
+            j += 32;
+            continue;
+        }
+
+        m = (unsigned int)_mm256_movemask_epi8(
+                _mm256_cmpgt_epi8(vlimit, x));
+        if (m == 0xffffffffU) {
+            _mm256_storeu_si256((__m256i *)(void *)(dst + j), sym);
+            j += 32;
+        } else {
+            j += simd_compress_128(dst + j, _mm256_castsi256_si128(sym),
+                                   m & 0xffff);
+            j += simd_compress_128(dst + j,
+                                   _mm256_extracti128_si256(sym, 1),
+                                   m >> 16);
+        }
+    }
+
+    /* Finish the 16-byte remainder. */
+    j += simd_map_ssse3(alphabet, alphacnt, mask, dst + j, dstlen - j,
+                        src + i, srclen - i, &u);
+    *used = i + u;
+    return j;
+}
+
+
+/*
+ * AVX-512 (VBMI/VBMI2) kernel: 64-byte permutes look up any alphabet, and
+ * masked loads/stores handle the partial vectors, so no scalar remainder
+ * is left.  A vector only partly needed is consumed up to the last
+ * accepted byte used (located with pdep).
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi,avx512vbmi2,bmi2")))
+static size_t
+simd_map_avx512(const unsigned char *alphabet, size_t alphacnt,
+                uint32_t mask, unsigned char *dst, size_t dstlen,
+                const unsigned char *src, size_t srclen, size_t *used)
+{
+    __m512i t0, t1, t2, t3, vmask, vlimit, x, sym;
+    __mmask64 lm, acc;
+    size_t i, j, n, c;
+
+    t0 = _mm512_loadu_si512((const void *)alphabet);
+    t1 = _mm512_loadu_si512((const void *)(alphabet + 64));
+    t2 = _mm512_loadu_si512((const void *)(alphabet + 128));
+    t3 = _mm512_loadu_si512((const void *)(alphabet + 192));
+    vmask = _mm512_set1_epi8((char)mask);
+    vlimit = _mm512_set1_epi8((char)alphacnt);
+
+    for (i = 0, j = 0; i < srclen && j < dstlen; i += n) {
+        n = (srclen - i < 64) ? srclen - i : 64;
+        lm = (n == 64) ? ~(__mmask64)0 : ((__mmask64)1 << n) - 1;
+        x = _mm512_and_si512(_mm512_maskz_loadu_epi8(lm, src + i), vmask);
+
+        if (mask < 64) {
+            sym = _mm512_permutexvar_epi8(x, t0);
+        } else if (mask < 128) {
+            sym = _mm512_permutex2var_epi8(t0, x, t1);
+        } else {
+            sym = _mm512_mask_blend_epi8(
+                    _mm512_movepi8_mask(x),
+                    _mm512_permutex2var_epi8(t0, x, t1),
+                    _mm512_permutex2var_epi8(t2, x, t3));
+        }
+
+        if (alphacnt == mask + 1) {
+            acc = lm;
+        } else {
+            acc = _mm512_mask_cmplt_epu8_mask(lm, x, vlimit);
+            sym = _mm512_maskz_compress_epi8(acc, sym);
+        }
+
+        c = (size_t)__builtin_popcountll(acc);
+        if (c >= dstlen - j) {
+            /* Stop right after the last accepted byte needed. */
+            c = dstlen - j;
+            n = (size_t)__builtin_ctzll(_pdep_u64(1ULL << (c - 1), acc)) + 1;
+        }
+        _mm512_mask_storeu_epi8(dst + j, (c == 64) ? ~(__mmask64)0 :
+                                ((__mmask64)1 << c) - 1, sym);
+        j += c;
+    }
+
+    *used = i;
+    return j;
+}
+
+
+/*
+ * Range check of the bytes <c> in [lo, lo + n): bias them so that the
+ * range starts at -128, then compare as signed bytes.
+ */
+#define SIMD_RANGE_128(c, lo, n) \
+        _mm_cmplt_epi8(_mm_add_epi8((c), _mm_set1_epi8((char)(0x80 - (lo)))), \
+                       _mm_set1_epi8((char)(-128 + (n))))
+#define SIMD_RANGE_256(c, lo, n) \
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (n))), \
+                          _mm256_add_epi8((c), \
+                                          _mm256_set1_epi8((char)(0x80 - (lo)))))
+
+/*
+ * Return the bitmask of the bytes of <c> in the base64url alphabet
+ * (A-Z a-z 0-9 - _); the letters are checked case-folded.
+ */
+__attribute__((target("sse2")))
+static inline unsigned int
+simd_b64url_128(__m128i c)
+{
+    __m128i v;
+
+    v = SIMD_RANGE_128(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 26);
+    v = _mm_or_si128(v, SIMD_RANGE_128(c, '0', 10));
+    v = _mm_or_si128(v, _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+    v = _mm_or_si128(v, _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+
+    return (unsigned int)_mm_movemask_epi8(v);
+}
+
+
+/*
+ * Return whether all the <len> (>= 16) bytes of <s> are in the base64url
+ * alphabet.  The last vector overlaps the previous one instead of falling
+ * back to scalar code.
+ */
+__attribute__((target("sse2")))
+static int
+simd_validate_sse2(const unsigned char *s, size_t len)
+{
+    unsigned int m = 0xffff;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+        m &= simd_b64url_128(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (i < len)
+        m &= simd_b64url_128(_mm_loadu_si128((const __m128i *)(s + len - 16)));
+
+    return m == 0xffff;
+}
+
+
+/*
+ * Same as simd_validate_sse2(), with <len> >= 32.
+ */
+__attribute__((target("avx2")))
+static int
+simd_validate_avx2(const unsigned char *s, size_t len)
+{
+    __m256i c, v, acc = _mm256_set1_epi8(-1);
+    size_t i = 0;
+
+    for (;;) {
+        if (i + 32 > len) {
+            if (i == len)
+                break;
+            i = len - 32;
+        }
+        c = _mm256_loadu_si256((const __m256i *)(s + i));
+        v = SIMD_RANGE_256(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+                           'a', 26);
+        v = _mm256_or_si256(v, SIMD_RANGE_256(c, '0', 10));
+        v = _mm256_or_si256(v, _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')));
+        v = _mm256_or_si256(v, _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+        acc = _mm256_and_si256(acc, v);
+        i += 32;
+    }
+
+    return _mm256_movemask_epi8(acc) == -1;
+}
+
+
+/*
+ * Packing of 64-symbol alphabets: every 4 symbols (6-bit indexes) make 3
+ * bytes, the first symbol in the high bits.
+ *
+ * The symbols are looked up in the 128-entry reverse table <rev> (index,
+ * or 0xff for a non-symbol); a byte >= 128 is never a symbol.  The indexes
+ * are merged by multiply-adds (a * 64 + b, then ab * 4096 + cd) and the
+ * 24-bit results shuffled to big-endian bytes.  Unpacking spreads every
+ * 3 bytes over a 32-bit lane and extracts the 4 fields with 16-bit
+ * multiplies, then looks up the symbols as the mapping kernels do.
+ * See: http://0x80.pl/notesen/2016-01-17-sse-base64-decoding.html
+ */
+
+/*
+ * Look up the bytes <x> in the 128-entry table <t> (8 16-byte rows); the
+ * bytes >= 128 get 0.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+simd_lookup128_128(const __m128i t[8], __m128i x)
+{
+    __m128i lo, hi, r;
+    int k;
+
+    lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+    hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x0f));
+    r = _mm_setzero_si128();
+    for (k = 0; k < 8; ++k) {
+        r = _mm_or_si128(r, _mm_and_si128(
+                _mm_shuffle_epi8(t[k], lo),
+                _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)k))));
+    }
+
+    return r;
+}
+
+
+/*
+ * Pack the 16 indexes <idx> into the low 12 bytes.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+simd_pack6_128(__m128i idx)
+{
+    __m128i v;
+
+    v = _mm_maddubs_epi16(idx, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                             14, 13, 12, -1, -1, -1, -1));
+}
+
+
+/*
+ * Unpack the low 12 bytes of <v> into 16 indexes.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+simd_unpack6_128(__m128i v)
+{
+    __m128i hi, lo;
+
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7,
+                                          10, 9, 11, 10));
+    hi = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                         _mm_set1_epi32(0x04000040));
+    lo = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                         _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(hi, lo);
+}
+
+
+__attribute__((target("ssse3")))
+static inline void
+simd_store12(unsigned char *dst, __m128i v)
+{
+    uint32_t w;
+
+    _mm_storel_epi64((__m128i *)(void *)dst, v);
+    w = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+    memcpy(dst + 8, &w, sizeof(w));
+}
+
+
+/*
+ * Pack the symbols <src> of length <len> into <dst>, 16 at a time, with
+ * the reverse table <rev>; 0x80 is set in <*bad> if any of them isn't a
+ * symbol.  Returns the number of symbols packed (a multiple of 4 if less
+ * than <len>); the caller packs the rest.
+ */
+__attribute__((target("ssse3")))
+static size_t
+simd_pack6_ssse3(const unsigned char *rev, unsigned char *dst,
+                 const unsigned char *src, size_t len, unsigned int *bad)
+{
+    __m128i t[8], x, idx, err;
+    size_t i;
+    int k;
+
+    for (k = 0; k < 8; ++k)
+        t[k] = _mm_loadu_si128((const __m128i *)(const void *)
+                               (rev + 16 * k));
+    err = _mm_setzero_si128();
+
+    for (i = 0; len - i >= 16; i += 16, dst += 12) {
+        x = _mm_loadu_si128((const __m128i *)(const void *)(src + i));
+        idx = simd_lookup128_128(t, x);
+        err = _mm_or_si128(err, _mm_or_si128(x, idx));
+        simd_store12(dst, simd_pack6_128(idx));
+    }
+
+    if (_mm_movemask_epi8(err) != 0)
+        *bad |= 0x80;
+    return i;
+}
+
+
+/*
+ * Unpack the bytes <src> of length <srclen> into at most <len> symbols of
+ * the 64-symbol <alphabet> stored into <dst>, 16 at a time; no byte beyond
+ * <srclen> is read.  Returns the number of symbols stored (a multiple of
+ * 4 if less than <len>); the caller unpacks the rest.
+ */
+__attribute__((target("ssse3")))
+static size_t
+simd_unpack6_ssse3(const unsigned char *alphabet, unsigned char *dst,
+                   size_t len, const unsigned char *src, size_t srclen)
+{
+    __m128i t[4], idx;
+    size_t i, j;
+    int k;
+
+    for (k = 0; k < 4; ++k)
+        t[k] = _mm_loadu_si128((const __m128i *)(const void *)
+                               (alphabet + 16 * k));
+
+    for (i = 0, j = 0; len - j >= 16 && srclen - i >= 16; i += 12, j += 16) {
+        idx = simd_unpack6_128(_mm_loadu_si128((const __m128i *)
+                                               (const void *)(src + i)));
+        _mm_storeu_si128((__m128i *)(void *)(dst + j),
+                         simd_lookup64_128(t, idx, 4));
+    }
+
+    return j;
+}
+
+
+/*
+ * AVX2 kernels: 32 symbols (24 bytes) at a time, both lanes working as
+ * above, and the 24 bytes gathered with a cross-lane permute.  A 16-symbol
+ * remainder is done with the (VEX-encoded) 128-bit code.
+ */
+__attribute__((target("avx2")))
+static size_t
+simd_pack6_avx2(const unsigned char *rev, unsigned char *dst,
+                const unsigned char *src, size_t len, unsigned int *bad)
+{
+    __m256i t[8], x, lo, hi, idx, v, err;
+    __m128i t128[8], x128, idx128;
+    size_t i;
+    int k;
+
+    for (k = 0; k < 8; ++k) {
+        t128[k] = _mm_loadu_si128((const __m128i *)(const void *)
+                                  (rev + 16 * k));
+        t[k] = _mm256_broadcastsi128_si256(t128[k]);
+    }
+    err = _mm256_setzero_si256();
+
+    for (i = 0; len - i >= 32; i += 32, dst += 24) {
+        x = _mm256_loadu_si256((const __m256i *)(const void *)(src + i));
+        lo = _mm256_and_si256(x, _mm256_set1_epi8(0x0f));
+        hi = _mm256_and_si256(_mm256_srli_epi16(x, 4),
+                              _mm256_set1_epi8(0x0f));
+        idx = _mm256_setzero_si256();
+        for (k = 0; k < 8; ++k) {
+            idx = _mm256_or_si256(idx, _mm256_and_si256(
+                    _mm256_shuffle_epi8(t[k], lo),
+                    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)k))));
+        }
+        err = _mm256_or_si256(err, _mm256_or_si256(x, idx));
+
+        v = _mm256_maddubs_epi16(idx, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5,
+                                                             6, 7, 7));
+        _mm_storeu_si128((__m128i *)(void *)dst, _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i *)(void *)(dst + 16),
+                         _mm256_extracti128_si256(v, 1));
+    }
+
+    if (len - i >= 16) {
+        x128 = _mm_loadu_si128((const __m128i *)(const void *)(src + i));
+        idx128 = simd_lookup128_128(t128, x128);
+        err = _mm256_or_si256(err, _mm256_castsi128_si256(
+                _mm_or_si128(x128, idx128)));
+        simd_store12(dst, simd_pack6_128(idx128));
+        i += 16;
+    }
+
+    if (_mm256_movemask_epi8(err) != 0)
+        *bad |= 0x80;
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+simd_unpack6_avx2(const unsigned char *alphabet, unsigned char *dst,
+                  size_t len, const unsigned char *src, size_t srclen)
+{
+    __m256i t[4], v, hi, lo, idx, sym;
+    __m128i t128[4], idx128;
+    size_t i, j;
+    int k;
+
+    for (k = 0; k < 4; ++k) {
+        t128[k] = _mm_loadu_si128((const __m128i *)(const void *)
+                                  (alphabet + 16 * k));
+        t[k] = _mm256_broadcastsi128_si256(t128[k]);
+    }
+
+    for (i = 0, j = 0; len - j >= 32 && srclen - i >= 32; i += 24, j += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(const void *)(src + i));
+        v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 0, 3,
+                                                             4, 5, 0));
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+        hi = _mm256_mulhi_epu16(
+                _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                _mm256_set1_epi32(0x04000040));
+        lo = _mm256_mullo_epi16(
+                _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                _mm256_set1_epi32(0x01000010));
+        idx = _mm256_or_si256(hi, lo);
+
+        lo = _mm256_and_si256(idx, _mm256_set1_epi8(0x0f));
+        hi = _mm256_and_si256(_mm256_srli_epi16(idx, 4),
+                              _mm256_set1_epi8(0x0f));
+        sym = _mm256_setzero_si256();
+        for (k = 0; k < 4; ++k) {
+            sym = _mm256_or_si256(sym, _mm256_and_si256(
+                    _mm256_shuffle_epi8(t[k], lo),
+                    _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)k))));
+        }
+        _mm256_storeu_si256((__m256i *)(void *)(dst + j), sym);
+    }
+
+    if (len - j >= 16 && srclen - i >= 16) {
+        idx128 = simd_unpack6_128(_mm_loadu_si128((const __m128i *)
+                                                  (const void *)(src + i)));
+        _mm_storeu_si128((__m128i *)(void *)(dst + j),
+                         simd_lookup64_128(t128, idx128, 4));
+        j += 16;
+    }
+
+    return j;
+}
+
+
+/*
+ * AVX-512 (VBMI) kernels: 64 symbols (48 bytes) at a time, looked up and
+ * gathered with byte permutes; masked loads/stores handle the last partial
+ * vector, so all the symbols are done (the pad bits left zero).
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi,avx512vbmi2,bmi2")))
+static size_t
+simd_pack6_avx512(const unsigned char *rev, unsigned char *dst,
+                  const unsigned char *src, size_t len, unsigned int *bad)
+{
+    unsigned char gather[64];
+    __m512i t0, t1, perm, x, idx, v;
+    __mmask64 lm, err;
+    size_t i, n, nb;
+    unsigned int g;
+
+    for (g = 0; g < 16; ++g) {
+        gather[3 * g] = (unsigned char)(4 * g + 2);
+        gather[3 * g + 1] = (unsigned char)(4 * g + 1);
+        gather[3 * g + 2] = (unsigned char)(4 * g);
+    }
+    memset(gather + 48, 0, 16);
+    perm = _mm512_loadu_si512((const void *)gather);
+    t0 = _mm512_loadu_si512((const void *)rev);
+    t1 = _mm512_loadu_si512((const void *)(rev + 64));
+    err = 0;
+
+    for (i = 0; i < len; i += n, dst += nb) {
+        n = (len - i < 64) ? len - i : 64;
+        nb = (n * 6 + 7) / 8;
+        lm = (n == 64) ? ~(__mmask64)0 : ((__mmask64)1 << n) - 1;
+        x = _mm512_maskz_loadu_epi8(lm, src + i);
+        idx = _mm512_maskz_permutex2var_epi8(lm, t0, x, t1);
+        err |= _mm512_movepi8_mask(_mm512_or_si512(x, idx));
+
+        v = _mm512_maddubs_epi16(idx, _mm512_set1_epi32(0x01400140));
+        v = _mm512_madd_epi16(v, _mm512_set1_epi32(0x00011000));
+        v = _mm512_permutexvar_epi8(perm, v);
+        _mm512_mask_storeu_epi8(dst, ((__mmask64)1 << nb) - 1, v);
+    }
+
+    if (err != 0)
+        *bad |= 0x80;
+    return len;
+}
+
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi,avx512vbmi2,bmi2")))
+static size_t
+simd_unpack6_avx512(const unsigned char *alphabet, unsigned char *dst,
+                    size_t len, const unsigned char *src, size_t srclen)
+{
+    unsigned char spread[64];
+    __m512i t, perm, v, hi, lo;
+    __mmask64 lm;
+    size_t i, j, n, nb;
+    unsigned int g;
+
+    (void)srclen; /* only the bytes of the <len> symbols are read */
+
+    for (g = 0; g < 16; ++g) {
+        spread[4 * g] = (unsigned char)(3 * g + 1);
+        spread[4 * g + 1] = (unsigned char)(3 * g);
+        spread[4 * g + 2] = (unsigned char)(3 * g + 2);
+        spread[4 * g + 3] = (unsigned char)(3 * g + 1);
+    }
+    perm = _mm512_loadu_si512((const void *)spread);
+    t = _mm512_loadu_si512((const void *)alphabet);
+
+    for (i = 0, j = 0; j < len; i += nb, j += n) {
+        n = (len - j < 64) ? len - j : 64;
+        nb = (n * 6 + 7) / 8;
+        lm = (n == 64) ? ~(__mmask64)0 : ((__mmask64)1 << n) - 1;
+        v = _mm512_maskz_loadu_epi8(((__mmask64)1 << nb) - 1, src + i);
+        v = _mm512_permutexvar_epi8(perm, v);
+        hi = _mm512_mulhi_epu16(
+                _mm512_and_si512(v, _mm512_set1_epi32(0x0fc0fc00)),
+                _mm512_set1_epi32(0x04000040));
+        lo = _mm512_mullo_epi16(
+                _mm512_and_si512(v, _mm512_set1_epi32(0x003f03f0)),
+                _mm512_set1_epi32(0x01000010));
+        v = _mm512_permutexvar_epi8(_mm512_or_si512(hi, lo), t);
+        _mm512_mask_storeu_epi8(dst + j, lm, v);
+    }
+
+    return len;
+}
+
+#endif /* HAVE_SIMD_X86 */
+
+#endif
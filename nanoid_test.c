@@ -28,7 +28,11 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "nanoid.h"
 
 /*--------------------------------------------------------------------------*/
 
@@ -227,3 +231,297 @@ sample_test(struct sample *s)
         return 1;
     }
 }
+
+/*--------------------------------------------------------------------------*/
+
+/*
+ * Kernel tests: the SIMD kernels must give the same results as the scalar
+ * one, on every one of them supported by the CPU.
+ */
+static const char *const test_kernels[] = {
+    "scalar", "ssse3", "avx2", "avx512",
+};
+#define TEST_NKERNELS   (sizeof(test_kernels) / sizeof(test_kernels[0]))
+#define TEST_MAXLEN     100
+#define TEST_BATCH      17
+#define TEST_MAXMAPLEN  257
+
+/* ID lengths covering the SIMD blocks (16, 32, 64 symbols) and tails */
+static const size_t test_lengths[] = {
+    1, 2, 3, 4, 5, 7, 8, 15, 16, 17, 21, 31, 32, 33, 47, 48, 63, 64, 65,
+    77, 96, 100,
+};
+#define TEST_NLENGTHS   (sizeof(test_lengths) / sizeof(test_lengths[0]))
+
+
+/*
+ * Report the failure of a kernel test, and return 1.
+ */
+static int
+test_fail(const char *what, const char *kernel, size_t bits, size_t len)
+{
+    printf("FAILED: %s (kernel %s, %zu bits, length %zu)\n",
+           what, kernel, bits, len);
+    return 1;
+}
+
+
+/*
+ * Generate IDs of length <len> with the alphabet <alphabet> (the default
+ * one if NULL) from the seeded source with every kernel, with
+ * nanoid_generate_r() and nanoid_generate_batch(), and compare them with
+ * the scalar kernel's, which catches dropped, duplicated or reordered
+ * symbols that the uniformity test can't see.  Returns the number of
+ * failures.
+ */
+static int
+test_map_alphabet(const unsigned char *alphabet, size_t alphacnt,
+                  size_t len)
+{
+    static unsigned char ref[(TEST_BATCH + 1) * TEST_MAXMAPLEN];
+    static unsigned char out[(TEST_BATCH + 1) * TEST_MAXMAPLEN];
+    size_t k, n = (TEST_BATCH + 1) * len;
+    int failed = 0;
+
+    for (k = 0; k < TEST_NKERNELS; ++k) {
+        if (nanoid_set_kernel(test_kernels[k]) == -1)
+            continue; /* not supported by the CPU */
+
+        nanoid_seed_random_source(42);
+        if (nanoid_generate_r(out, len, alphabet, alphacnt) == NULL ||
+            nanoid_generate_batch(out + len, TEST_BATCH, len, 0, 0,
+                                  alphabet, alphacnt) == NULL) {
+            failed += test_fail("generate", test_kernels[k], alphacnt, len);
+            continue;
+        }
+        if (k == 0)
+            memcpy(ref, out, n);
+        else if (memcmp(out, ref, n) != 0)
+            failed += test_fail("map != scalar", test_kernels[k], alphacnt,
+                                len);
+    }
+
+    return failed;
+}
+
+
+/*
+ * Run the mapping tests for alphabets of power-of-2 and other sizes, up to
+ * and beyond the 64 symbols of the SSSE3/AVX2 kernels, at lengths around
+ * the SIMD blocks.  Restores the kernel <kernel> when done, but leaves the
+ * seeded source selected.
+ */
+static int
+test_map(const char *kernel)
+{
+    static const size_t sizes[] = { 2, 10, 16, 36, 62, 64, 100, 128, 255 };
+    static const size_t lengths[] = {
+        1, 21, 31, 32, 33, 63, 64, 65, 255, 256, 257,
+    };
+    unsigned char alphabet[255];
+    size_t si, li, i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(alphabet); ++i)
+        alphabet[i] = (unsigned char)(i + 1);
+
+    for (li = 0; li < sizeof(lengths) / sizeof(lengths[0]); ++li) {
+        failed += test_map_alphabet(NULL, 0, lengths[li]);
+        for (si = 0; si < sizeof(sizes) / sizeof(sizes[0]); ++si)
+            failed += test_map_alphabet(alphabet, sizes[si], lengths[li]);
+    }
+
+    nanoid_set_kernel(kernel);
+    printf("Map: %s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}
+
+
+/*
+ * Pack and unpack random IDs of the alphabet <alphabet> of 2^<bits>
+ * symbols with every kernel, and check the round trips, the agreement with
+ * the scalar kernel, and the rejection of a non-symbol byte and of
+ * non-zero pad bits.  Returns the number of failures.
+ */
+static int
+test_pack_alphabet(const unsigned char *alphabet, size_t bits)
+{
+    static unsigned char ids[TEST_BATCH * TEST_MAXLEN];
+    static unsigned char ref[TEST_BATCH * TEST_MAXLEN];
+    static unsigned char out[TEST_BATCH * TEST_MAXLEN];
+    static unsigned char back[TEST_BATCH * TEST_MAXLEN];
+    unsigned char member[256], bad;
+    size_t alphacnt = (size_t)1 << bits, li, len, psize, k, i;
+    int failed = 0;
+
+    memset(member, 0, sizeof(member));
+    for (i = 0; i < alphacnt; ++i)
+        member[alphabet[i]] = 1;
+    for (bad = 0; member[bad]; ++bad)
+        ;
+
+    for (li = 0; li < TEST_NLENGTHS; ++li) {
+        len = test_lengths[li];
+        psize = nanoid_packed_size(len, alphabet, alphacnt);
+        if (nanoid_generate_batch(ids, TEST_BATCH, len, 0, 0, alphabet,
+                                  alphacnt) == NULL)
+            return test_fail("generate", "-", bits, len);
+
+        for (k = 0; k < TEST_NKERNELS; ++k) {
+            if (nanoid_set_kernel(test_kernels[k]) == -1)
+                continue; /* not supported by the CPU */
+
+            if (nanoid_pack_batch(out, ids, TEST_BATCH, len, 0, alphabet,
+                                  alphacnt) == NULL) {
+                failed += test_fail("pack", test_kernels[k], bits, len);
+                continue;
+            }
+            if (k == 0)
+                memcpy(ref, out, TEST_BATCH * psize);
+            else if (memcmp(out, ref, TEST_BATCH * psize) != 0)
+                failed += test_fail("pack != scalar", test_kernels[k],
+                                    bits, len);
+            for (i = 0; i < TEST_BATCH; ++i) {
+                if (nanoid_pack(back, ids + i * len, len, alphabet,
+                                alphacnt) == NULL ||
+                    memcmp(back, out + i * psize, psize) != 0) {
+                    failed += test_fail("pack != pack_batch",
+                                        test_kernels[k], bits, len);
+                    break;
+                }
+            }
+
+            if (nanoid_unpack_batch(back, TEST_BATCH, len, 0, 0, out,
+                                    alphabet, alphacnt) == NULL ||
+                memcmp(back, ids, TEST_BATCH * len) != 0)
+                failed += test_fail("unpack_batch round trip",
+                                    test_kernels[k], bits, len);
+            if (nanoid_unpack(back, len, out, alphabet, alphacnt) == NULL ||
+                memcmp(back, ids, len) != 0)
+                failed += test_fail("unpack round trip", test_kernels[k],
+                                    bits, len);
+
+            /* A non-symbol byte, at every position */
+            memcpy(back, ids, len);
+            for (i = 0; i < len; ++i) {
+                back[i] = bad;
+                if (nanoid_pack(out, back, len, alphabet,
+                                alphacnt) != NULL) {
+                    failed += test_fail("non-symbol accepted",
+                                        test_kernels[k], bits, len);
+                    break;
+                }
+                back[i] = ids[i];
+            }
+
+            /* Non-zero pad bits */
+            if ((len * bits) % 8 != 0) {
+                memcpy(out, ref, psize);
+                out[psize - 1] |= 1;
+                if (nanoid_unpack(back, len, out, alphabet,
+                                  alphacnt) != NULL)
+                    failed += test_fail("pad bits accepted",
+                                        test_kernels[k], bits, len);
+            }
+        }
+    }
+
+    return failed;
+}
+
+
+/*
+ * Run the pack tests for the alphabets of 2..128 symbols, including the
+ * 64-symbol ASCII ones converted by the SIMD kernels, and one of non-ASCII
+ * symbols.  Restores the kernel <kernel> when done.
+ */
+static int
+test_pack(const char *kernel)
+{
+    unsigned char alphabet[128];
+    size_t bits, i;
+    int failed = 0;
+
+    for (bits = 1; bits <= 7; ++bits) {
+        /* Printable symbols, then the other bytes */
+        for (i = 0; i < ((size_t)1 << bits); ++i)
+            alphabet[i] = (unsigned char)(i < 94 ? '!' + i : 128 + i);
+        failed += test_pack_alphabet(alphabet, bits);
+    }
+    failed += test_pack_alphabet(
+            (const unsigned char *)NANOID_ALPHABET, 6);
+    failed += test_pack_alphabet(
+            (const unsigned char *)NANOID_SORTABLE_ALPHABET, 6);
+    for (i = 0; i < 64; ++i)
+        alphabet[i] = (unsigned char)(0xc0 + i);
+    failed += test_pack_alphabet(alphabet, 6);
+
+    nanoid_set_kernel(kernel);
+    printf("Pack: %s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}
+
+
+/*
+ * Check nanoid_validate() and nanoid_validate_batch() with the default
+ * alphabet on every kernel against the membership table path (the same
+ * alphabet given explicitly): random IDs, and the IDs with every byte
+ * value at every position.  Restores the kernel <kernel> when done.
+ */
+static int
+test_validate(const char *kernel)
+{
+    static const unsigned char *const alphabet =
+            (const unsigned char *)NANOID_ALPHABET;
+    static unsigned char ids[TEST_BATCH * TEST_MAXLEN];
+    unsigned char valid[TEST_BATCH], ref[TEST_BATCH], save;
+    size_t li, len, k, i, pos;
+    int c, v, all, failed = 0;
+
+    for (li = 0; li < TEST_NLENGTHS; ++li) {
+        len = test_lengths[li];
+
+        for (k = 0; k < TEST_NKERNELS; ++k) {
+            if (nanoid_set_kernel(test_kernels[k]) == -1)
+                continue; /* not supported by the CPU */
+
+            if (nanoid_generate_batch(ids, TEST_BATCH, len, 0, 0, NULL,
+                                      0) == NULL)
+                return test_fail("generate", "-", 6, len);
+
+            /* Every byte value at every position of the first ID */
+            for (pos = 0; pos < len; ++pos) {
+                save = ids[pos];
+                for (c = 0; c < 256; ++c) {
+                    ids[pos] = (unsigned char)c;
+                    v = nanoid_validate(ids, len, alphabet, 64);
+                    if (nanoid_validate(ids, len, NULL, 0) != v ||
+                        nanoid_validate_batch(ids, 1, len, 0, NULL, 0,
+                                              NULL) != v)
+                        break;
+                }
+                ids[pos] = save;
+                if (c < 256) {
+                    failed += test_fail("validate != table",
+                                        test_kernels[k], 6, len);
+                    break;
+                }
+            }
+
+            /* A batch of valid IDs and IDs with one corrupted byte */
+            for (i = 1; i < TEST_BATCH; i += 2)
+                ids[i * len + i % len] = (unsigned char)(i * 37);
+            all = nanoid_validate_batch(ids, TEST_BATCH, len, 0, alphabet,
+                                        64, ref);
+            if (nanoid_validate_batch(ids, TEST_BATCH, len, 0, NULL, 0,
+                                      valid) != all ||
+                memcmp(valid, ref, TEST_BATCH) != 0)
+                failed += test_fail("validate_batch != table",
+                                    test_kernels[k], 6, len);
+        }
+    }
+
+    nanoid_set_kernel(kernel);
+    printf("Validate: %s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}
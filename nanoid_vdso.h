@@ -0,0 +1,256 @@
+/*-
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2023 Aaron LI
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+/*
+ * getrandom() through the Linux vDSO (Linux >= 6.11), which generates
+ * random data in user space without entering the kernel.
+ *
+ * The symbol is looked up at run time in the vDSO image found via
+ * getauxval(AT_SYSINFO_EHDR), so a binary built anywhere uses the fast
+ * path wherever the running kernel provides it.
+ *
+ * Reference: linux/tools/testing/selftests/vDSO/parse_vdso.c
+ */
+
+#ifndef NANOID_VDSO_H_
+#define NANOID_VDSO_H_
+
+#include <elf.h>
+#include <errno.h>
+#include <link.h> /* ElfW() */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/auxv.h> /* getauxval() */
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h> /* sysconf() */
+
+typedef ssize_t (*vdso_getrandom_fn)(void *, size_t, unsigned int,
+                                     void *, size_t);
+
+/*
+ * Parameters of the opaque per-thread state, returned by the vDSO when
+ * called with <opaque_len> == ~0.
+ */
+struct vdso_getrandom_params {
+    uint32_t    size_of_opaque_state;
+    uint32_t    mmap_prot;
+    uint32_t    mmap_flags;
+    uint32_t    reserved[13];
+};
+
+static struct {
+    vdso_getrandom_fn   fn;
+    size_t              statesz;
+    size_t              mapsz;
+    int                 prot;
+    int                 flags;
+} vdso_rng;
+
+static pthread_once_t vdso_once = PTHREAD_ONCE_INIT;
+static pthread_key_t vdso_key;
+static __thread void *vdso_state;
+
+
+/*
+ * Find the address of the function symbol <name> in the vDSO image,
+ * or return 0.
+ */
+static uintptr_t
+vdso_lookup(const char *name)
+{
+    const ElfW(Ehdr) *eh;
+    const ElfW(Phdr) *ph;
+    const ElfW(Dyn) *dyn = NULL, *d;
+    const ElfW(Sym) *symtab = NULL, *sym;
+    const ElfW(Word) *hash = NULL;
+    const char *strtab = NULL;
+    uintptr_t base, load = 0;
+    int have_load = 0;
+    size_t i;
+
+    base = (uintptr_t)getauxval(AT_SYSINFO_EHDR);
+    if (base == 0)
+        return 0;
+
+    eh = (const ElfW(Ehdr) *)base;
+    ph = (const ElfW(Phdr) *)(base + eh->e_phoff);
+    for (i = 0; i < eh->e_phnum; ++i) {
+        if (ph[i].p_type == PT_LOAD && !have_load) {
+            load = base + (uintptr_t)ph[i].p_offset - ph[i].p_vaddr;
+            have_load = 1;
+        } else if (ph[i].p_type == PT_DYNAMIC) {
+            dyn = (const ElfW(Dyn) *)(base + ph[i].p_offset);
+        }
+    }
+    if (!have_load || dyn == NULL)
+        return 0;
+
+    for (d = dyn; d->d_tag != DT_NULL; ++d) {
+        switch (d->d_tag) {
+        case DT_SYMTAB:
+            symtab = (const ElfW(Sym) *)(load + d->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            strtab = (const char *)(load + d->d_un.d_ptr);
+            break;
+        case DT_HASH:
+            hash = (const ElfW(Word) *)(load + d->d_un.d_ptr);
+            break;
+        }
+    }
+    if (symtab == NULL || strtab == NULL || hash == NULL)
+        return 0;
+
+    /* The number of symbols is the chain count of the hash table. */
+    for (i = 0; i < hash[1]; ++i) {
+        sym = &symtab[i];
+        if ((sym->st_info & 0xf) != STT_FUNC ||
+            ((sym->st_info >> 4) != STB_GLOBAL &&
+             (sym->st_info >> 4) != STB_WEAK) ||
+            sym->st_shndx == SHN_UNDEF)
+            continue;
+        if (strcmp(strtab + sym->st_name, name) == 0)
+            return load + (uintptr_t)sym->st_value;
+    }
+
+    return 0;
+}
+
+
+static void
+vdso_destroy(void *p)
+{
+    munmap(p, vdso_rng.mapsz);
+    vdso_state = NULL;
+}
+
+
+static void
+vdso_init_once(void)
+{
+    struct vdso_getrandom_params params;
+    vdso_getrandom_fn fn;
+    uintptr_t addr;
+    long pagesz;
+
+    addr = vdso_lookup("__vdso_getrandom"); /* x86, LoongArch */
+    if (addr == 0)
+        addr = vdso_lookup("__kernel_getrandom"); /* arm64, ppc, s390 */
+    if (addr == 0)
+        return;
+
+    fn = (vdso_getrandom_fn)addr;
+    memset(&params, 0, sizeof(params));
+    if (fn(NULL, 0, 0, &params, ~(size_t)0) != 0 ||
+        params.size_of_opaque_state == 0)
+        return;
+
+    pagesz = sysconf(_SC_PAGESIZE);
+    if (pagesz <= 0)
+        pagesz = 4096;
+    if (pthread_key_create(&vdso_key, vdso_destroy) != 0)
+        return;
+
+    vdso_rng.statesz = params.size_of_opaque_state;
+    vdso_rng.mapsz = (vdso_rng.statesz + (size_t)pagesz - 1) &
+                     ~((size_t)pagesz - 1);
+    vdso_rng.prot = (int)params.mmap_prot;
+    vdso_rng.flags = (int)params.mmap_flags;
+    vdso_rng.fn = fn;
+}
+
+
+/*
+ * Return whether the running kernel provides getrandom() in the vDSO.
+ */
+static inline int
+vdso_getrandom_available(void)
+{
+    if (pthread_once(&vdso_once, vdso_init_once) != 0)
+        return 0;
+    return vdso_rng.fn != NULL;
+}
+
+
+/*
+ * Return the opaque state of the calling thread, allocating it on first
+ * use. The kernel-provided mapping flags include MAP_DROPPABLE, which
+ * also wipes the state in a forked child.
+ */
+static void *
+vdso_get_state(void)
+{
+    void *p;
+
+    if (vdso_state != NULL)
+        return vdso_state;
+
+    p = mmap(NULL, vdso_rng.mapsz, vdso_rng.prot, vdso_rng.flags, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (pthread_setspecific(vdso_key, p) != 0) {
+        munmap(p, vdso_rng.mapsz);
+        return NULL;
+    }
+
+    vdso_state = p;
+    return p;
+}
+
+
+/*
+ * Fill the buffer <buf> of size <n> with vDSO getrandom().
+ * vdso_getrandom_available() must have returned true.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static inline int
+vdso_getrandom(void *buf, size_t n)
+{
+    unsigned char *p = (unsigned char *)buf;
+    void *state;
+    ssize_t r;
+
+    if ((state = vdso_get_state()) == NULL)
+        return -1;
+
+    while (n > 0) {
+        r = vdso_rng.fn(p, n, 0, state, vdso_rng.statesz);
+        if (r < 0) {
+            if (r == -EINTR)
+                continue;
+            errno = (int)-r;
+            return -1;
+        }
+        p += r;
+        n -= (size_t)r;
+    }
+
+    return 0;
+}
+
+
+#endif
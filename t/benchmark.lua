@@ -23,37 +23,237 @@
 -- SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 --]]
 
-local clock = os.clock
+--[[
+Benchmark suite of the Lua modules: every API (per call, batch and
+generator) of the Lua C interface and, with LuaJIT, of the FFI interface,
+over several ID lengths and alphabets.
+
+Usage: lua t/benchmark.lua [--json] [--count N] [--trials N]
+
+Every case is warmed up, then timed over several trials of about <count>
+default-length IDs (fewer for longer IDs), and reported as the median and
+MAD (median absolute deviation) in ns/id.  The memory allocated per ID is
+measured in a separate run with the GC stopped, from
+collectgarbage("count").
+--]]
+
 local floor = math.floor
 local format = string.format
 
-function benchmark(count, burnin, f, ...)
-    burnin = burnin or floor(count / 10)
-    local tstart, tend
+local count = 200000
+local trials = 5
+local json = false
+
+do
+    local i = 1
+    while arg and arg[i] do
+        local a = arg[i]
+        if a == "--json" then
+            json = true
+        elseif a == "--count" then
+            i = i + 1
+            count = tonumber(arg[i])
+        elseif a == "--trials" then
+            i = i + 1
+            trials = tonumber(arg[i])
+        else
+            error("unknown argument: " .. a)
+        end
+        i = i + 1
+    end
+    if not count or count < 1000 or not trials or trials < 1 then
+        error("invalid --count or --trials")
+    end
+end
+
 
-    print(format("Burning in ... (n=%d)", burnin))
-    for i = 1, burnin do
-        f(...)
+-- Wall clock timer: clock_gettime() through the FFI if available, then
+-- LuaSocket, else the CPU time of os.clock().
+local now, timer
+do
+    local has_ffi, ffi = pcall(require, "ffi")
+    if has_ffi and ffi.os == "Linux" then
+        ffi.cdef[[
+        typedef struct { long tv_sec; long tv_nsec; } nanoid_bench_timespec;
+        int clock_gettime(int clk_id, nanoid_bench_timespec *tp);
+        ]]
+        local ts = ffi.new("nanoid_bench_timespec")
+        local CLOCK_MONOTONIC = 1
+        now = function()
+            ffi.C.clock_gettime(CLOCK_MONOTONIC, ts)
+            return tonumber(ts.tv_sec) + tonumber(ts.tv_nsec) * 1e-9
+        end
+        timer = "clock_gettime"
+    else
+        local has_socket, socket = pcall(require, "socket")
+        if has_socket and socket.gettime then
+            now = socket.gettime
+            timer = "socket.gettime"
+        else
+            now = os.clock
+            timer = "os.clock"
+        end
     end
+end
+
+
+local function median(v)
+    table.sort(v)
+    local n = #v
+    if n % 2 == 1 then
+        return v[(n + 1) / 2]
+    end
+    return (v[n / 2] + v[n / 2 + 1]) / 2
+end
 
-    print(format("Running test ... (n=%d)", count))
-    tstart = clock()
-    for i = 1, count do
-        f(...)
+
+-- Median and MAD of the trials of <run>, in ns/id
+local function measure(run, n)
+    run(floor(n / 10)) -- warm up
+
+    local t = {}
+    for i = 1, trials do
+        local tstart = now()
+        run(n)
+        t[i] = (now() - tstart) * 1e9 / n
+    end
+    local med = median(t)
+    for i = 1, trials do
+        t[i] = math.abs(t[i] - med)
     end
-    tend = clock()
+    return med, median(t)
+end
+
 
-    local v1 = floor((tend - tstart) * 1e9 / count)
-    local v2 = floor(count / (tend - tstart))
-    print(format("Speed: %d ns/id, %d id/s", v1, v2))
+-- Bytes allocated per ID by <run>, with the GC stopped
+local function allocated(run, n)
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local before = collectgarbage("count")
+    run(n)
+    local after = collectgarbage("count")
+    collectgarbage("restart")
+    collectgarbage("collect")
+    return (after - before) * 1024 / n
 end
 
-print(">>> Lua C Interface")
-local nanoid = require("nanoid")
-benchmark(2000000, nil, nanoid.generate)
 
+local BATCH = 100 -- IDs per generate_many() call
+local KEEP = 200 -- last IDs kept alive
+
+-- Runners of <n> IDs for every API of module <m>.  The results are stored
+-- in <keep>, or the LuaJIT compiler would sink the unused strings and never
+-- create them.
+local function runners(m, length, alphabet)
+    local generate, generate_many, new = m.generate, m.generate_many, m.new
+    local keep = {}
+    local list = {}
+
+    if length == nil and alphabet == nil then
+        list[#list + 1] = { "generate", function(n)
+            for i = 1, n do
+                keep[i % KEEP + 1] = generate()
+            end
+        end }
+    else
+        list[#list + 1] = { "generate", function(n)
+            for i = 1, n do
+                keep[i % KEEP + 1] = generate(length, alphabet)
+            end
+        end }
+    end
+    if generate_many then
+        list[#list + 1] = { "generate_many", function(n)
+            for i = 1, floor(n / BATCH) do
+                keep[i % (KEEP / BATCH) + 1] = generate_many(BATCH, length,
+                                                             alphabet)
+            end
+        end }
+    end
+    if new then
+        local gen = new(length, alphabet)
+        list[#list + 1] = { "new", function(n)
+            for i = 1, n do
+                keep[i % KEEP + 1] = gen()
+            end
+        end }
+    end
+    return list
+end
+
+
+local modules = { { "c", require("nanoid") } }
 if _G.jit then
-    print(">>> LuaJIT FFI Interface")
-    local nanoid = require("nanoid.ffi")
-    benchmark(2000000, nil, nanoid.generate)
+    local ok, m = pcall(require, "nanoid.ffi")
+    if ok then
+        modules[#modules + 1] = { "ffi", m }
+    end
+end
+
+-- { length, alphabet, alphabet size }; nil for the defaults
+local configs = {
+    { nil, nil, 64 },
+    { 8, nil, 64 },
+    { 64, nil, 64 },
+    { 256, nil, 64 },
+    { 21, "0123456789", 10 },
+    { 21, "0123456789abcdef", 16 },
+    { 21, "0123456789abcdefghijklmnopqrstuvwxyz", 36 },
+}
+
+local results = {}
+
+if not json then
+    print(format("%s%s, timer %s, %d trials", _VERSION,
+                 _G.jit and (" (" .. _G.jit.version .. ")") or "", timer,
+                 trials))
+    print(format("%-6s %-14s %6s %5s %10s %8s %12s", "module", "api",
+                 "length", "alpha", "ns/id", "mad", "bytes/id"))
+end
+
+-- The modules are run in turn for every configuration, so that they're
+-- compared under the same conditions
+for _, conf in ipairs(configs) do
+    local length = conf[1] or 21
+    local n = floor(count * 21 / length / BATCH) * BATCH
+    if n < 1000 then
+        n = 1000
+    end
+    for _, mod in ipairs(modules) do
+        for _, r in ipairs(runners(mod[2], conf[1], conf[2])) do
+            local med, mad = measure(r[2], n)
+            local bytes = allocated(r[2], floor(n / 10))
+            local res = {
+                module = mod[1], api = r[1], length = length,
+                alphabet = conf[3], ids = n, median = med, mad = mad,
+                bytes = bytes,
+            }
+            results[#results + 1] = res
+            if not json then
+                print(format("%-6s %-14s %6d %5d %10.1f %8.1f %12.1f",
+                             res.module, res.api, res.length, res.alphabet,
+                             res.median, res.mad, res.bytes))
+            end
+        end
+    end
+end
+
+if json then
+    local out = {}
+    out[#out + 1] = format('{"lua": "%s", "jit": %s, "timer": "%s", ' ..
+                           '"trials": %d, "count": %d,\n "results": [',
+                           _VERSION, _G.jit and
+                           ('"' .. _G.jit.version .. '"') or "null",
+                           timer, trials, count)
+    for i, res in ipairs(results) do
+        out[#out + 1] = format('%s\n  {"module": "%s", "api": "%s", ' ..
+                               '"length": %d, "alphabet": %d, ' ..
+                               '"ids": %d, "ns_median": %.3f, ' ..
+                               '"ns_mad": %.3f, "bytes_per_id": %.3f}',
+                               i > 1 and "," or "", res.module, res.api,
+                               res.length, res.alphabet, res.ids,
+                               res.median, res.mad, res.bytes)
+    end
+    out[#out + 1] = "\n ]}"
+    print(table.concat(out))
 end